@@ -1,220 +1,282 @@
-#include <EEPROM.h>
-
-#define NO_EEPROM
-
-const byte tacho_interrupt_pin = 1;
-const byte speedo_interrupt_pin = 2;
-const short UPDATE_RATE = 500;  // milliseconds
-const float RATIO_TOLERANCE = 0.05;  // percent
-
-unsigned int ctr_tacho = 0;
-unsigned int ctr_speedo = 0;
-unsigned int check_time = 0;
-unsigned short ratios[6] = {65535, 65535, 65535, 65535, 65535, 65535};  // store the ratios multiplied by 1000 so we don't need floats
-byte num_ratios = 0;
-byte current_gear = 0;
-char debug_string[100];
-
-void setup() {
-  noInterrupts();
-  Serial.begin(115200);
-  attachInterrupt(digitalPinToInterrupt(tacho_interrupt_pin), isr_tacho, RISING);
-  attachInterrupt(digitalPinToInterrupt(speedo_interrupt_pin), isr_speedo, RISING);
-  load_ratios_from_eeprom();
-  interrupts();
-}
-
-void loop() {
-  /*The loop.
-  */
-  int now = millis();
-  if (now == check_time){
-    check_time = now + UPDATE_RATE;
-    main_func();
-  }
-//  delay(1000);
-}
-
-int main_func(void){
-  /*The function that does all the work.
-  */
-  volatile int now_tacho = ctr_tacho;
-  volatile int now_speedo = ctr_speedo;
-  ctr_tacho = 0;
-  ctr_speedo = 0;
-  float ratio = calculate_ratio(now_tacho, now_speedo);
-  byte gear = calculate_gear(ratio);
-  sprintf(debug_string, "tacho(%10u) speed(%10u) ratio(%10.5f) gear(%1u)", now_tacho, now_speedo, ratio, gear);
-  Serial.println(debug_string);
-}
-
-byte calculate_gear(float ratio) {
-  /*Calculate the current gear based on the ratio given
-  */
-  // loop through the currently known ratios and find where this one fits in
-  byte matched_gear = 255;
-  for (byte ctr = 0; ctr < 6; ctr++) {
-    float this_ratio = ratios[ctr] / 1000.0;
-    float this_ratio_upper_limit = this_ratio * (1 + RATIO_TOLERANCE);
-    float this_ratio_lower_limit = this_ratio * (1 - RATIO_TOLERANCE);
-    bool match = (ratio > this_ratio_lower_limit) && (ratio <= this_ratio_upper_limit);
-    if (match) {
-      matched_gear = ctr;
-      break;
-    }
-  }
-  if (matched_gear == 255) {
-    matched_gear = update_gear_table(ratio);
-  }
-  return matched_gear;
-}
-
-byte update_gear_table(float new_ratio) {
-  /*Given a ratio that could not be matched to a currently known one, put it in the list.
-  */
-  new_ratio *= 1000;
-  byte new_gear = 255;
-  if (num_ratios == 0) {
-    // it's the first one
-    ratios[0] = new_ratio;
-    new_gear = 0;
-    num_ratios = 1;
-  }
-  else if (new_ratio > (ratios[num_ratios] * (1 + RATIO_TOLERANCE))) {  // bigger than anything in the list
-    ratios[num_ratios] = new_ratio;
-    new_gear = num_ratios;
-    num_ratios++;
-  }
-  else {
-    // find the first time it's smaller than a ratio's upper limit
-    unsigned short new_ratios[6];
-    memcpy(new_ratios, ratios, 6*2);
-    byte lower_match = 255;
-    for (byte ctr = 0; ctr < num_ratios; ctr++) {
-      float this_ratio = ratios[ctr] / 1000.0;
-      float this_ratio_upper_limit = this_ratio * (1 + RATIO_TOLERANCE);
-      if (new_ratio < this_ratio_upper_limit) {
-        lower_match = ctr;
-        break;
-      }
-    }
-    if (lower_match == 255) {
-      // this should never happen
-      Serial.println("But somehow it did?");
-      return 255;
-    }
-    // lower chunk
-    byte dest_offset = 0;
-    byte src_offset = 0;
-    byte num_bytes_to_copy = lower_match * 2;
-    memcpy(ratios + dest_offset, new_ratios + src_offset, num_bytes_to_copy);
-    sprintf(debug_string, "lower_memcpy(%i, %i, %i)", dest_offset, src_offset, num_bytes_to_copy);
-    Serial.println(debug_string);
-    // upper chunk
-    dest_offset = num_bytes_to_copy + 2;
-    src_offset = num_bytes_to_copy;
-    num_bytes_to_copy = 12 - dest_offset;
-    memcpy(ratios + dest_offset, new_ratios + src_offset, num_bytes_to_copy);
-    sprintf(debug_string, "upper_memcpy(%i, %i, %i)", dest_offset, src_offset, num_bytes_to_copy);
-    Serial.println(debug_string);
-    // new value
-    ratios[lower_match] = new_ratio;
-    new_gear = lower_match;
-    num_ratios++;
-  }
-  if (new_gear < 255) {
-    Serial.print("Found a new gear at ");
-    Serial.print(new_gear);
-    Serial.println(".");
-    save_to_eeprom();
-  }
-  return new_gear;
-}
-
-float calculate_ratio(int tacho, int speedo) {
-  /*Given the last tacho and speedo counters, calculate the current gear ratio
-  */
-  if (speedo == 0 || tacho == 0) {
-    return -1;
-  }
-  return (1.0 * tacho) / speedo;
-}
-
-void write_seven_seg(int number) {
-  // given an int 0 - 6, write a number to the seven seg display
-  switch(number) {
-    case 0:
-      Serial.println("gear(N)");
-      break;
-    case 1:
-      Serial.println("gear(1)");
-      break;
-    case 2:
-      Serial.println("gear(2)");
-      break;
-    case 3:
-      Serial.println("gear(3)");
-      break;
-    case 4:
-      Serial.println("gear(4)");
-      break;
-    case 5:
-      Serial.println("gear(5)");
-      break;
-    case 6:
-      Serial.println("gear(6)");
-      break;
-    default:
-      Serial.println("gear(eRR)");
-      break;
-  }
-}
-
-void load_ratios_from_eeprom() {
-  /*Load the table of known ratios from the EEPROM.
-  */
-  #ifdef NO_EEPROM
-  return;
-  #endif
-  byte version_major = EEPROM.read(0);
-  byte version_minor = EEPROM.read(1);
-  num_ratios = EEPROM.read(2);
-  if (num_ratios == 255) {  // the default case
-    num_ratios = 0;
-  }
-  byte address_ctr = 3;
-  for (byte ctr = 0; ctr < num_ratios; ctr++) {
-    ratios[ctr] = (EEPROM.read(address_ctr + 1) << 8) || EEPROM.read(address_ctr);
-    address_ctr += 2;
-  }
-  sprintf(debug_string, "software_version(%u.%u) known_ratios(%i)", version_major, version_minor, num_ratios);
-  Serial.println(debug_string);
-}
-
-void save_to_eeprom() {
-  /*Save the current table to EEPROM.
-  */
-  #ifdef NO_EEPROM
-  return;
-  #endif
-  byte address_ctr = 3;
-  for (byte ctr = 0; ctr < num_ratios; ctr++) {
-    EEPROM.write(address_ctr, ratios[ctr] & 255);
-    EEPROM.write(address_ctr + 1, ratios[ctr] >> 8);
-    address_ctr += 2;
-  }
-  sprintf(debug_string, "saved known_ratios(%i) to EEPROM", num_ratios);
-  Serial.println(debug_string);
-}
-
-void isr_tacho() {
-  // just increment the tacho counter
-  ctr_tacho++;
-}
-
-void isr_speedo() {
-  // just increment the speedo counter
-  ctr_speedo++;
-}
-
-// end
+#include <EEPROM.h>
+#include <GearClassifier.h>
+#include <GearFilter.h>
+
+#define NO_EEPROM
+//#define PERIOD_DETECTION  // the gear from every speedo period, timed by Timer1 input capture, with the speedo on ICP1 not speedo_interrupt_pin
+
+const byte tacho_interrupt_pin = 1;
+const byte speedo_interrupt_pin = 2;
+const byte speedo_capture_pin = 8;  // ICP1, the speedo goes here for period detection
+const short UPDATE_RATE = 500;  // milliseconds
+const unsigned int RATIO_TOLERANCE = 50;  // parts per thousand either side of a known ratio
+const byte MAX_GEARS = 6;
+const unsigned int MIN_SPEEDO = 3;  // speedo counts an update below which the bike is as good as stopped
+
+unsigned int ctr_tacho = 0;
+unsigned int ctr_speedo = 0;
+unsigned int check_time = 0;
+GearClassifier classifier(RATIO_TOLERANCE, MAX_GEARS);  // the ratios are stored multiplied by 1000 so we don't need floats
+GearFilter gear_filter(&classifier, MIN_SPEEDO);
+byte current_gear = 0;
+char debug_string[100];
+
+/* Period detection:
+  Timer1 runs free at 2MHz, and its overflow interrupt counts the high word,
+  so timestamps are 32 bits of half microseconds. The speedo edge is caught
+  by the input capture unit, which latches the time in hardware. The tacho
+  ISR timestamps its edges from the counter. At each speedo edge the ISR
+  hands over the speedo period, and how many tacho edges there were over
+  how long. The ratio of the two frequencies, the same thing the counts
+  give, is then the speedo period over the mean tacho period, so a new gear
+  is worked out every wheel sensor period with no divide.
+*/
+#ifdef PERIOD_DETECTION
+volatile unsigned int timer1_overflows = 0;
+volatile unsigned long last_speedo_edge = 0;
+volatile unsigned long last_tacho_edge = 0;
+volatile unsigned long tacho_span_start = 0;  // the last tacho edge before the last speedo edge
+volatile unsigned int tacho_edges = 0;  // since then
+volatile bool tacho_timing = false;  // is tacho_span_start a real edge yet?
+volatile bool speedo_timing = false;  // and last_speedo_edge?
+volatile byte period_due = 0;
+volatile unsigned long period_speedo;  // handed over at each speedo edge
+volatile unsigned long period_tacho_span;
+volatile unsigned int period_tacho_edges;
+#endif
+
+void setup() {
+  noInterrupts();
+  Serial.begin(115200);
+  attachInterrupt(digitalPinToInterrupt(tacho_interrupt_pin), isr_tacho, RISING);
+  #ifdef PERIOD_DETECTION
+  start_period_timer();
+  #else
+  attachInterrupt(digitalPinToInterrupt(speedo_interrupt_pin), isr_speedo, RISING);
+  #endif
+  load_ratios_from_eeprom();
+  interrupts();
+}
+
+void loop() {
+  /*The loop.
+  */
+  #ifdef PERIOD_DETECTION
+  period_func();
+  #else
+  int now = millis();
+  if (now == check_time){
+    check_time = now + UPDATE_RATE;
+    main_func();
+  }
+  #endif
+//  delay(1000);
+}
+
+int main_func(void){
+  /*The function that does all the work.
+  */
+  volatile int now_tacho = ctr_tacho;
+  volatile int now_speedo = ctr_speedo;
+  ctr_tacho = 0;
+  ctr_speedo = 0;
+  byte gear = calculate_gear(now_tacho, now_speedo);
+  sprintf(debug_string, "tacho(%10u) speed(%10u) gear(%1u)", now_tacho, now_speedo, gear);
+  Serial.println(debug_string);
+}
+
+byte calculate_gear(unsigned int tacho, unsigned int speedo) {
+  /*Calculate the current gear from the tacho and speedo counts. Known gears
+  are matched without any floats or divides. A ratio that doesn't match one
+  has to keep turning up before it is learned as a new gear, and the known
+  ones are refined as they are ridden in. The filter holds the gear shown
+  through shifts, clutch-in and coasting.
+  */
+  byte matched_gear = gear_filter.update(tacho, speedo, millis());
+  save_changed_ratios();
+  return matched_gear;
+}
+
+void save_changed_ratios(void) {
+  /*Save the gear table if the classifier has learned or moved a ratio
+  */
+  if (classifier.take_changed()) {
+    sprintf(debug_string, "gear table changed, known_ratios(%u)", classifier.num_gears());
+    Serial.println(debug_string);
+    save_to_eeprom();
+  }
+}
+
+void write_seven_seg(int number) {
+  // given an int 0 - 6, write a number to the seven seg display
+  switch(number) {
+    case 0:
+      Serial.println("gear(N)");
+      break;
+    case 1:
+      Serial.println("gear(1)");
+      break;
+    case 2:
+      Serial.println("gear(2)");
+      break;
+    case 3:
+      Serial.println("gear(3)");
+      break;
+    case 4:
+      Serial.println("gear(4)");
+      break;
+    case 5:
+      Serial.println("gear(5)");
+      break;
+    case 6:
+      Serial.println("gear(6)");
+      break;
+    default:
+      Serial.println("gear(eRR)");
+      break;
+  }
+}
+
+void load_ratios_from_eeprom() {
+  /*Load the table of known ratios from the EEPROM.
+  */
+  #ifdef NO_EEPROM
+  return;
+  #endif
+  byte version_major = EEPROM.read(0);
+  byte version_minor = EEPROM.read(1);
+  byte num_ratios = EEPROM.read(2);
+  if (num_ratios > MAX_GEARS) {  // the default case is 255
+    num_ratios = 0;
+  }
+  unsigned short ratios[MAX_GEARS];
+  byte address_ctr = 3;
+  for (byte ctr = 0; ctr < num_ratios; ctr++) {
+    ratios[ctr] = (EEPROM.read(address_ctr + 1) << 8) | EEPROM.read(address_ctr);
+    address_ctr += 2;
+  }
+  classifier.set_ratios(ratios, num_ratios);
+  sprintf(debug_string, "software_version(%u.%u) known_ratios(%i)", version_major, version_minor, num_ratios);
+  Serial.println(debug_string);
+}
+
+void save_to_eeprom() {
+  /*Save the current table to EEPROM.
+  */
+  #ifdef NO_EEPROM
+  return;
+  #endif
+  byte num_ratios = classifier.num_gears();
+  EEPROM.write(2, num_ratios);
+  byte address_ctr = 3;
+  for (byte ctr = 0; ctr < num_ratios; ctr++) {
+    EEPROM.write(address_ctr, classifier.get_ratio(ctr) & 255);
+    EEPROM.write(address_ctr + 1, classifier.get_ratio(ctr) >> 8);
+    address_ctr += 2;
+  }
+  sprintf(debug_string, "saved known_ratios(%i) to EEPROM", num_ratios);
+  Serial.println(debug_string);
+}
+
+#ifdef PERIOD_DETECTION
+void period_func(void) {
+  /*Work out the gear from the last speedo period, if there is a new one. The
+  filter does the sums, and says when there hasn't been one for long enough
+  to take the bike as stopped. Only changes of gear are printed, there are
+  too many periods to print them all.
+  */
+  unsigned long now = millis();
+  unsigned long speedo_period = 0;
+  unsigned int edges = 0;
+  byte gear;
+  if (1 == period_due) {
+    noInterrupts();
+    speedo_period = period_speedo;
+    unsigned long tacho_span = period_tacho_span;
+    edges = period_tacho_edges;
+    period_due = 0;
+    interrupts();
+    gear = gear_filter.update_period(speedo_period, edges, tacho_span, now);
+  }
+  else if (gear_filter.stalled(now)) {
+    noInterrupts();
+    speedo_timing = false;
+    tacho_timing = false;
+    interrupts();
+    gear = gear_filter.get_gear();
+  }
+  else
+    return;
+  save_changed_ratios();
+  if (gear != current_gear) {
+    current_gear = gear;
+    sprintf(debug_string, "speedo_period(%lu) tacho_edges(%u) gear(%u)", speedo_period / 2, edges, gear);
+    Serial.println(debug_string);
+  }
+}
+
+void start_period_timer(void) {
+  /*Run Timer1 free at 2MHz, capturing rising edges on ICP1 with the noise
+  canceller on, and interrupting on each capture and overflow
+  */
+  pinMode(speedo_capture_pin, INPUT);
+  TCCR1A = 0;
+  TCCR1B = _BV(ICNC1) | _BV(ICES1) | _BV(CS11);
+  TCNT1 = 0;
+  TIFR1 = _BV(ICF1) | _BV(TOV1);
+  TIMSK1 = _BV(ICIE1) | _BV(TOIE1);
+}
+
+unsigned long timer1_time(unsigned int low) {
+  /*Put the high word on a Timer1 count taken with interrupts off. An overflow
+  still pending happened before the count if the count is small.
+  */
+  unsigned int high = timer1_overflows;
+  if ((TIFR1 & _BV(TOV1)) && (low < 0x8000))
+    high++;
+  return ((unsigned long)high << 16) | low;
+}
+
+ISR(TIMER1_OVF_vect) {
+  timer1_overflows++;
+}
+
+ISR(TIMER1_CAPT_vect) {
+  /*A speedo edge. Hand the period since the last one, and the tacho edges
+  over it, to the loop.
+  */
+  unsigned long edge = timer1_time(ICR1);
+  if (speedo_timing && tacho_timing) {
+    period_speedo = edge - last_speedo_edge;
+    period_tacho_span = last_tacho_edge - tacho_span_start;
+    period_tacho_edges = tacho_edges;
+    period_due = 1;
+  }
+  speedo_timing = true;
+  last_speedo_edge = edge;
+  if (0 != tacho_edges)
+    tacho_span_start = last_tacho_edge;
+  tacho_edges = 0;
+}
+#endif
+
+void isr_tacho() {
+  // increment the tacho counter, and timestamp the edge for period detection
+  ctr_tacho++;
+  #ifdef PERIOD_DETECTION
+  last_tacho_edge = timer1_time(TCNT1);
+  if (tacho_timing)
+    tacho_edges++;
+  else {
+    tacho_span_start = last_tacho_edge;
+    tacho_timing = true;
+  }
+  #endif
+}
+
+void isr_speedo() {
+  // just increment the speedo counter
+  ctr_speedo++;
+}
+
+// end
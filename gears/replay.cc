@@ -0,0 +1,629 @@
+/*
+Replay tacho and speedo counts through the classifier and filter the gears
+sketch runs, to tune RATIO_TOLERANCE and the learning on ride data.
+
+Build with:
+  g++ -O2 -std=c++11 -I../sketchbook/libraries/GearClassifier/src -o replay replay.cc \
+    ../sketchbook/libraries/GearClassifier/src/GearClassifier.cpp ../sketchbook/libraries/GearClassifier/src/GearFilter.cpp
+
+Usage:
+  replay [-t tolerance]... [-g max_gears] [-m min_speedo] [-w window_ms] [-p] [-v] trace.csv
+  replay [-t tolerance]... [-s seconds] [-r seed] [-o trace.csv] [-g ...]
+
+The trace is CSV from log_decoder -c, with a gear column added on the end
+to label it: 1 for first, 0 for neutral or stopped, and blank where it isn't
+known, such as mid-shift. Without a file a ride is made up, labelled as it
+goes, and -o saves it. The samples are summed into windows of -w, as the
+sketch counts over UPDATE_RATE. With -p each sample's counts are laid out
+as edges, a period apart where the sample logged one, and the sketch's
+PERIOD_DETECTION is played over them: its ISRs' bookkeeping, then the
+filter's update_period() at each speedo edge and stalled() between them.
+The shown gear is then scored each sample. Each -t replays the trace at
+another tolerance.
+
+For each tolerance it prints the share of labelled windows showing the right
+gear, how long a new gear took to show, and the time an update takes on this
+machine. Gears are numbered by the order of their ratios as they are
+learned, not as the rider numbers them, so each label is matched to the
+gear shown most while it held.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "GearClassifier.h"
+#include "GearFilter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static unsigned long long clock_ticks(void) { return __rdtsc(); }
+#define TICK_UNITS "TSC cycles"
+#else
+static unsigned long long clock_ticks(void) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#define TICK_UNITS "ns"
+#endif
+
+// the gears sketch's settings, as the defaults
+const unsigned int DEFAULT_TOLERANCE = 50;
+const byte DEFAULT_MAX_GEARS = 6;
+const unsigned int DEFAULT_MIN_SPEEDO = 3;
+const unsigned long DEFAULT_WINDOW = 500;  // milliseconds, UPDATE_RATE
+
+const int LABEL_UNKNOWN = -1;
+const unsigned long SYNTH_SAMPLE_MS = 10;
+const int SYNTH_GEARS = 6;
+const double SYNTH_RATIOS[SYNTH_GEARS] = {2.4, 1.65, 1.25, 1.0, 0.85, 0.75};  // tacho over speedo pulses
+const double SYNTH_CLUTCH = 50;  // tacho Hz, two pulses a rev, with the clutch in
+const double SYNTH_PULL_AWAY = 70;
+const double SYNTH_REDLINE = 280;
+
+struct Sample {
+  unsigned int session;
+  unsigned long time;  // milliseconds
+  unsigned int tacho;  // counts over the sample
+  unsigned int speedo;
+  unsigned long tacho_period;  // microseconds, zero if none
+  unsigned long speedo_period;
+  int label;  // the gear the rider was in, 1 for first, 0 for none, or LABEL_UNKNOWN
+};
+
+struct Edge {
+  unsigned long time;  // microseconds
+  bool speedo;  // or tacho
+};
+
+struct Window {
+  unsigned int session;
+  unsigned long time;  // at its end
+  unsigned int tacho;  // what the sketch hands the filter
+  unsigned int speedo;
+  int label;  // of its last sample
+  bool mixed;  // the label changed during the window, so it isn't scored
+  unsigned long label_start;  // when the label of its last sample began
+  std::vector<Edge> edges;  // over the window, in order, for PERIOD_DETECTION
+};
+
+struct PeriodTimer {
+  /* What the sketch's Timer1 ISRs keep between edges
+  */
+  unsigned long last_speedo_edge;
+  unsigned long last_tacho_edge;
+  unsigned long tacho_span_start;  // the last tacho edge before the last speedo edge
+  unsigned int tacho_edges;  // since then
+  bool tacho_timing;  // is tacho_span_start a real edge yet?
+  bool speedo_timing;  // and last_speedo_edge?
+};
+
+static void usage(void) {
+  fprintf(stderr, "usage: replay [-t tolerance]... [-g max_gears] [-m min_speedo] [-w window_ms] [-p] [-v] trace.csv\n");
+  fprintf(stderr, "       replay [-t tolerance]... [-s seconds] [-r seed] [-o trace.csv] [-g ...]\n");
+  exit(1);
+}
+
+static std::vector<std::string> split_csv(const char *line) {
+  /* Split a line on commas, keeping empty fields
+  */
+  std::vector<std::string> fields(1);
+  for (const char *ptr = line; ('\0' != *ptr) && ('\n' != *ptr) && ('\r' != *ptr); ptr++) {
+    if (',' == *ptr)
+      fields.push_back("");
+    else
+      fields.back() += *ptr;
+  }
+  return fields;
+}
+
+static int find_column(const std::vector<std::string> &header, const char *name) {
+  for (size_t ctr = 0; ctr < header.size(); ctr++) {
+    if (header[ctr] == name)
+      return ctr;
+  }
+  return -1;
+}
+
+static bool read_trace(const char *path, std::vector<Sample> *samples, bool *labelled) {
+  /* Read a trace in log_decoder's CSV, with or without a gear column
+  */
+  FILE *in = fopen(path, "r");
+  if (NULL == in)
+    return false;
+  char line[512];
+  if (NULL == fgets(line, sizeof(line), in)) {
+    fclose(in);
+    return false;
+  }
+  std::vector<std::string> header = split_csv(line);
+  int session_col = find_column(header, "session");
+  int time_col = find_column(header, "time");
+  int tacho_col = find_column(header, "tacho");
+  int speedo_col = find_column(header, "speedo");
+  int tacho_period_col = find_column(header, "tacho_period");
+  int speedo_period_col = find_column(header, "speedo_period");
+  int gear_col = find_column(header, "gear");
+  if ((time_col < 0) || (tacho_col < 0) || (speedo_col < 0)) {
+    fprintf(stderr, "%s needs time, tacho and speedo columns\n", path);
+    fclose(in);
+    return false;
+  }
+  *labelled = gear_col >= 0;
+  while (NULL != fgets(line, sizeof(line), in)) {
+    std::vector<std::string> fields = split_csv(line);
+    if (fields.size() < header.size())
+      fields.resize(header.size());
+    Sample sample;
+    sample.session = (session_col >= 0) ? atoi(fields[session_col].c_str()) : 0;
+    sample.time = strtoul(fields[time_col].c_str(), NULL, 10);
+    sample.tacho = atoi(fields[tacho_col].c_str());
+    sample.speedo = atoi(fields[speedo_col].c_str());
+    sample.tacho_period = (tacho_period_col >= 0) ? strtoul(fields[tacho_period_col].c_str(), NULL, 10) : 0;
+    sample.speedo_period = (speedo_period_col >= 0) ? strtoul(fields[speedo_period_col].c_str(), NULL, 10) : 0;
+    sample.label = LABEL_UNKNOWN;
+    if ((gear_col >= 0) && !fields[gear_col].empty())
+      sample.label = atoi(fields[gear_col].c_str());
+    samples->push_back(sample);
+  }
+  fclose(in);
+  return true;
+}
+
+static bool write_trace(const char *path, const std::vector<Sample> &samples) {
+  /* Write a trace as log_decoder does, with the gear column on the end
+  */
+  FILE *out = fopen(path, "w");
+  if (NULL == out)
+    return false;
+  fprintf(out, "session,time,tacho,speedo,neutral,tacho_period,speedo_period,samples_missed,sample_latency,gear\n");
+  for (size_t ctr = 0; ctr < samples.size(); ctr++) {
+    const Sample &sample = samples[ctr];
+    fprintf(out, "%u,%lu,%u,%u,%u,%lu,%lu,0,0,", sample.session, sample.time, sample.tacho, sample.speedo,
+      0 == sample.label, sample.tacho_period, sample.speedo_period);
+    if (LABEL_UNKNOWN != sample.label)
+      fprintf(out, "%d", sample.label);
+    fprintf(out, "\n");
+  }
+  return 0 == fclose(out);
+}
+
+class Ride {
+  /* Make up a ride: pull away, shift up and down through the box, coast with
+    the clutch in and stop, with jitter on the sensors and the odd spurious
+    tacho pulse. Counts come from the pulse phase, so they carry the same
+    quantising a real window has.
+  */
+  public:
+    Ride(unsigned long seed) : random(seed), time(0), tacho_phase(0), speedo_phase(0) {}
+
+    void make(unsigned long seconds, std::vector<Sample> *out) {
+      samples = out;
+      while (time < seconds * 1000) {
+        run(0, 0, 0, 0, 0, 2000, 0);  // stopped
+        int gear = 1;
+        tacho_now = SYNTH_PULL_AWAY;
+        run(LABEL_UNKNOWN, SYNTH_CLUTCH, tacho_now, 0, tacho_now / SYNTH_RATIOS[0], 1000, 0);  // slipping the clutch
+        int shifts = 4 + uniform(0, 12);
+        for (int ctr = 0; ctr < shifts; ctr++) {
+          double ratio = SYNTH_RATIOS[gear - 1];
+          bool down = (SYNTH_GEARS == gear) || ((gear > 1) && (uniform(0, 1) < 0.3));
+          double target = down ? uniform(100, 140) : uniform(180, SYNTH_REDLINE);
+          run(gear, tacho_now, target, tacho_now / ratio, target / ratio, uniform(2000, 6000), 0.015);
+          double speedo = target / ratio;
+          int next = down ? gear - 1 : gear + 1;
+          if (uniform(0, 1) < 0.15) {
+            // clutch in and coast a while, then pick a gear to suit
+            double slower = speedo * uniform(0.5, 0.8);
+            run(LABEL_UNKNOWN, target, SYNTH_CLUTCH, speedo, slower, uniform(1000, 5000), 0.02);
+            speedo = slower;
+            next = gear;
+            while ((next > 1) && (speedo * SYNTH_RATIOS[next - 1] < SYNTH_PULL_AWAY))
+              next--;
+          }
+          double next_tacho = speedo * SYNTH_RATIOS[next - 1];
+          run(LABEL_UNKNOWN, SYNTH_CLUTCH, next_tacho, speedo, speedo, uniform(250, 600), 0.02);  // the shift
+          gear = next;
+          tacho_now = next_tacho;
+        }
+        double ratio = SYNTH_RATIOS[gear - 1];
+        run(gear, tacho_now, SYNTH_PULL_AWAY, tacho_now / ratio, SYNTH_PULL_AWAY / ratio, 2000, 0.015);  // slowing
+        run(LABEL_UNKNOWN, SYNTH_CLUTCH, SYNTH_CLUTCH, SYNTH_PULL_AWAY / ratio, 0, 3000, 0.02);  // clutch in to a stop
+      }
+    }
+
+  private:
+    double uniform(double low, double high) {
+      return low + (high - low) * (random() / 4294967296.0);
+    }
+
+    void run(int label, double tacho_from, double tacho_to, double speedo_from, double speedo_to, double ms,
+        double jitter) {
+      /* Ramp the sensor frequencies, in Hz, over a stretch of the ride
+      */
+      unsigned long stretch = ms / SYNTH_SAMPLE_MS;
+      for (unsigned long ctr = 1; ctr <= stretch; ctr++) {
+        double progress = (double)ctr / stretch;
+        double speedo_hz = speedo_from + (speedo_to - speedo_from) * progress;
+        double tacho_hz = tacho_from + (tacho_to - tacho_from) * progress;
+        tacho_hz *= 1 + uniform(-jitter, jitter);
+        Sample sample;
+        sample.session = 0;
+        time += SYNTH_SAMPLE_MS;
+        sample.time = time;
+        double old_tacho = tacho_phase;
+        double old_speedo = speedo_phase;
+        tacho_phase += tacho_hz * SYNTH_SAMPLE_MS / 1000;
+        speedo_phase += speedo_hz * SYNTH_SAMPLE_MS / 1000;
+        sample.tacho = (unsigned int)(floor(tacho_phase) - floor(old_tacho));
+        sample.speedo = (unsigned int)(floor(speedo_phase) - floor(old_speedo));
+        if (uniform(0, 1) < 0.002)
+          sample.tacho += 1 + uniform(0, 3);  // ignition noise
+        sample.tacho_period = (tacho_hz > 1) ? 1e6 / tacho_hz : 0;
+        sample.speedo_period = (speedo_hz > 1) ? 1e6 / speedo_hz : 0;
+        sample.label = label;
+        samples->push_back(sample);
+      }
+      tacho_now = tacho_to;
+    }
+
+    std::mt19937 random;
+    std::vector<Sample> *samples;
+    unsigned long time;
+    double tacho_phase;  // pulses so far
+    double speedo_phase;
+    double tacho_now;  // where the last stretch left the tacho
+};
+
+static void add_window(std::vector<Window> *windows, const Sample &last, unsigned long tacho, unsigned long speedo,
+    bool mixed, unsigned long label_start) {
+  Window window;
+  window.session = last.session;
+  window.time = last.time;
+  window.tacho = (tacho > 0xffff) ? 0xffff : tacho;  // an unsigned int on the Uno
+  window.speedo = (speedo > 0xffff) ? 0xffff : speedo;
+  window.label = last.label;
+  window.mixed = mixed;
+  window.label_start = label_start;
+  windows->push_back(window);
+}
+
+static void add_edges(std::vector<Edge> *edges, unsigned int count, unsigned long period, unsigned long start,
+    unsigned long end, unsigned long *last_edge, bool speedo) {
+  /* Lay a sample's count out as edges over it, in microseconds: a period on
+    from the last edge if the sample has one, otherwise evenly spread. Kept
+    inside the sample, so the counts still add up.
+  */
+  for (unsigned int ctr = 0; ctr < count; ctr++) {
+    unsigned long time = start + (end - start) * (ctr + 1) / count;
+    if ((0 != period) && (0 != *last_edge))
+      time = *last_edge + period;
+    if (time <= start)
+      time = start + 1;
+    if (time > end)
+      time = end;
+    if (time <= *last_edge)
+      time = *last_edge + 1;
+    Edge edge;
+    edge.time = time;
+    edge.speedo = speedo;
+    edges->push_back(edge);
+    *last_edge = time;
+  }
+}
+
+static bool edge_before(const Edge &edge_a, const Edge &edge_b) {
+  return edge_a.time < edge_b.time;
+}
+
+static std::vector<Window> make_windows(const std::vector<Sample> &samples, unsigned long window_ms, bool periods) {
+  /* Sum the samples into windows, as the sketch counts over UPDATE_RATE. With
+    periods, each sample is a window of its own carrying its edges, for
+    replay() to time the way PERIOD_DETECTION does.
+  */
+  unsigned long last_tacho_edge = 0;
+  unsigned long last_speedo_edge = 0;
+  std::vector<Window> windows;
+  unsigned long tacho = 0;
+  unsigned long speedo = 0;
+  unsigned long window_start = 0;
+  unsigned long label_start = 0;
+  bool mixed = false;
+  bool open = false;
+  for (size_t ctr = 0; ctr < samples.size(); ctr++) {
+    const Sample &sample = samples[ctr];
+    bool new_session = (0 == ctr) || (sample.session != samples[ctr - 1].session);
+    if (new_session || (sample.label != samples[ctr - 1].label)) {
+      label_start = sample.time;
+      mixed |= open && !new_session;
+    }
+    if (periods) {
+      unsigned long end = sample.time * 1000;
+      unsigned long start = new_session ? end - SYNTH_SAMPLE_MS * 1000 : samples[ctr - 1].time * 1000;
+      if (new_session) {
+        last_tacho_edge = 0;
+        last_speedo_edge = 0;
+      }
+      add_window(&windows, sample, sample.tacho, sample.speedo, false, label_start);
+      std::vector<Edge> &edges = windows.back().edges;
+      add_edges(&edges, sample.tacho, sample.tacho_period, start, end, &last_tacho_edge, false);
+      add_edges(&edges, sample.speedo, sample.speedo_period, start, end, &last_speedo_edge, true);
+      std::stable_sort(edges.begin(), edges.end(), edge_before);
+      continue;
+    }
+    if (new_session || !open) {
+      tacho = 0;
+      speedo = 0;
+      window_start = sample.time;
+      mixed = false;
+      open = true;
+    }
+    tacho += sample.tacho;
+    speedo += sample.speedo;
+    bool last = (ctr + 1 == samples.size()) || (samples[ctr + 1].session != sample.session);
+    if ((sample.time - window_start >= window_ms) || last) {
+      add_window(&windows, sample, tacho, speedo, mixed, label_start);
+      open = false;
+    }
+  }
+  return windows;
+}
+
+static void period_edges(GearFilter *filter, PeriodTimer *timer, const Window &window,
+    std::vector<unsigned int> *counts, unsigned long long *ticks_total, unsigned long long *ticks_worst) {
+  /* Play a window's edges through the sketch's PERIOD_DETECTION: the ISRs'
+    bookkeeping, update_period() at each speedo edge with a period, and
+    stalled() as the loop would have polled it, up to the end of the window.
+    The counts each period was classified on go on the end of counts.
+  */
+  for (size_t ctr = 0; ctr < window.edges.size(); ctr++) {
+    const Edge &edge = window.edges[ctr];
+    if (filter->stalled((edge.time - 1) / 1000)) {
+      timer->speedo_timing = false;
+      timer->tacho_timing = false;
+    }
+    if (!edge.speedo) {
+      timer->last_tacho_edge = edge.time;
+      if (timer->tacho_timing)
+        timer->tacho_edges++;
+      else {
+        timer->tacho_span_start = edge.time;
+        timer->tacho_timing = true;
+      }
+      continue;
+    }
+    if (timer->speedo_timing && timer->tacho_timing) {
+      unsigned long speedo_period = edge.time - timer->last_speedo_edge;
+      unsigned long tacho_span = timer->last_tacho_edge - timer->tacho_span_start;
+      unsigned long long start = clock_ticks();
+      filter->update_period(speedo_period, timer->tacho_edges, tacho_span, edge.time / 1000);
+      unsigned long long ticks = clock_ticks() - start;
+      *ticks_total += ticks;
+      if (ticks > *ticks_worst)
+        *ticks_worst = ticks;
+      unsigned int tacho;
+      unsigned int speedo;
+      GearFilter::period_counts(speedo_period, timer->tacho_edges, tacho_span, &tacho, &speedo);
+      counts->push_back(tacho);
+      counts->push_back(speedo);
+    }
+    timer->speedo_timing = true;
+    timer->last_speedo_edge = edge.time;
+    if (0 != timer->tacho_edges)
+      timer->tacho_span_start = timer->last_tacho_edge;
+    timer->tacho_edges = 0;
+  }
+  if (filter->stalled(window.time)) {
+    timer->speedo_timing = false;
+    timer->tacho_timing = false;
+  }
+}
+
+static void replay(const std::vector<Window> &windows, bool labelled, bool periods, unsigned int tolerance,
+    byte max_gears, unsigned int min_speedo, bool verbose) {
+  /* Run the windows through a fresh classifier and filter, then score what
+    was shown against the labels. The filter starts afresh each session,
+    the learned gears carry on, as they would in EEPROM.
+  */
+  GearClassifier classifier(tolerance, max_gears);
+  GearFilter filter(&classifier, min_speedo);
+  PeriodTimer timer = PeriodTimer();
+  std::vector<byte> shown(windows.size());
+  std::vector<unsigned int> counts;  // tacho then speedo, for each update
+  unsigned long long ticks_total = 0;
+  unsigned long long ticks_worst = 0;
+  unsigned long table_changes = 0;
+  for (size_t ctr = 0; ctr < windows.size(); ctr++) {
+    const Window &window = windows[ctr];
+    if ((ctr > 0) && (window.session != windows[ctr - 1].session)) {
+      filter.reset();
+      timer = PeriodTimer();
+    }
+    if (periods) {
+      period_edges(&filter, &timer, window, &counts, &ticks_total, &ticks_worst);
+      shown[ctr] = filter.get_gear();
+    }
+    else {
+      unsigned long long start = clock_ticks();
+      shown[ctr] = filter.update(window.tacho, window.speedo, window.time);
+      unsigned long long ticks = clock_ticks() - start;
+      ticks_total += ticks;
+      if (ticks > ticks_worst)
+        ticks_worst = ticks;
+      counts.push_back(window.tacho);
+      counts.push_back(window.speedo);
+    }
+    table_changes += classifier.take_changed();
+    if (verbose)
+      printf("%u %8lu tacho(%5u) speedo(%5u) label(%2d%s) gear(%3u) state(%u)\n", window.session, window.time,
+        window.tacho, window.speedo, window.label, window.mixed ? "*" : "", shown[ctr], filter.get_state());
+  }
+  // and the classifier on its own, with the gears it ended up with
+  const unsigned int CLASSIFY_PASSES = 20;
+  volatile byte sink = 0;
+  unsigned long long start = clock_ticks();
+  size_t updates = counts.size() / 2;
+  for (unsigned int pass = 0; pass < CLASSIFY_PASSES; pass++) {
+    for (size_t ctr = 0; ctr < updates; ctr++)
+      sink += classifier.classify(counts[2 * ctr], counts[2 * ctr + 1]);
+  }
+  double classify_ticks = (double)(clock_ticks() - start) / (CLASSIFY_PASSES * (updates ? updates : 1));
+
+  printf("tolerance %u: %zu windows, %zu updates, %u gears learned [", tolerance, windows.size(), updates,
+    classifier.num_gears());
+  for (byte ctr = 0; ctr < classifier.num_gears(); ctr++)
+    printf("%s%u", ctr ? ", " : "", classifier.get_ratio(ctr));
+  printf("], table changed %lu times\n", table_changes);
+  printf("  update %.0f %s mean, %llu worst, classify %.0f mean\n", (double)ticks_total / (updates ? updates : 1),
+    TICK_UNITS, ticks_worst, classify_ticks);
+  if (!labelled)
+    return;
+
+  // match each label to the gear shown most while it held, neutral to none
+  const int LABELS = 32;
+  unsigned long votes[LABELS][GEAR_MAX_GEARS + 1];
+  memset(votes, 0, sizeof(votes));
+  for (size_t ctr = 0; ctr < windows.size(); ctr++) {
+    int label = windows[ctr].label;
+    if ((label > 0) && (label < LABELS) && !windows[ctr].mixed)
+      votes[label][(GEAR_NONE == shown[ctr]) ? GEAR_MAX_GEARS : shown[ctr]]++;
+  }
+  int gear_for[LABELS];
+  for (int label = 0; label < LABELS; label++) {
+    gear_for[label] = GEAR_NONE;
+    unsigned long most = 0;
+    for (byte gear = 0; gear < GEAR_MAX_GEARS; gear++) {
+      if (votes[label][gear] > most) {
+        most = votes[label][gear];
+        gear_for[label] = gear;
+      }
+    }
+  }
+
+  unsigned long scored = 0;
+  unsigned long right = 0;
+  unsigned long right_by_label[LABELS] = {0};
+  unsigned long scored_by_label[LABELS] = {0};
+  for (size_t ctr = 0; ctr < windows.size(); ctr++) {
+    int label = windows[ctr].label;
+    if ((label < 0) || (label >= LABELS) || windows[ctr].mixed)
+      continue;
+    scored++;
+    scored_by_label[label]++;
+    if (shown[ctr] == gear_for[label]) {
+      right++;
+      right_by_label[label]++;
+    }
+  }
+  printf("  %.1f%% of %lu labelled windows right\n", scored ? 100.0 * right / scored : 0.0, scored);
+  for (int label = 0; label < LABELS; label++) {
+    if (0 == scored_by_label[label])
+      continue;
+    printf("    label %d as gear ", label);
+    if (GEAR_NONE == gear_for[label])
+      printf("none");
+    else
+      printf("%d", gear_for[label]);
+    printf(": %.1f%% of %lu\n", 100.0 * right_by_label[label] / scored_by_label[label], scored_by_label[label]);
+  }
+
+  // how long from the rider changing gear to it being shown
+  unsigned long changes = 0;
+  unsigned long missed = 0;
+  unsigned long latency_total = 0;
+  unsigned long latency_worst = 0;
+  int last_label = LABEL_UNKNOWN;  // the last known one, through unknown stretches
+  bool waiting = false;  // for the current label to be shown
+  unsigned long run_start = 0;
+  for (size_t ctr = 0; ctr < windows.size(); ctr++) {
+    const Window &window = windows[ctr];
+    bool new_session = (0 == ctr) || (window.session != windows[ctr - 1].session);
+    if (new_session || (window.label_start != windows[ctr - 1].label_start) || (window.label != windows[ctr - 1].label)) {
+      missed += waiting;
+      waiting = false;
+      if (new_session)
+        last_label = LABEL_UNKNOWN;
+      if ((window.label >= 0) && (window.label < LABELS)) {
+        if ((LABEL_UNKNOWN != last_label) && (window.label != last_label)) {
+          changes++;
+          waiting = true;
+          run_start = window.label_start;
+        }
+        last_label = window.label;
+      }
+    }
+    if (waiting && (shown[ctr] == gear_for[window.label])) {
+      unsigned long latency = window.time - run_start;
+      latency_total += latency;
+      if (latency > latency_worst)
+        latency_worst = latency;
+      waiting = false;
+    }
+  }
+  missed += waiting;
+  unsigned long seen = changes - missed;
+  printf("  %lu gear changes: shown after %.0fms mean, %lums worst, %lu never shown\n", changes,
+    seen ? (double)latency_total / seen : 0.0, latency_worst, missed);
+}
+
+int main(int argc, char **argv) {
+  std::vector<unsigned int> tolerances;
+  byte max_gears = DEFAULT_MAX_GEARS;
+  unsigned int min_speedo = DEFAULT_MIN_SPEEDO;
+  unsigned long window_ms = DEFAULT_WINDOW;
+  unsigned long seconds = 600;
+  unsigned long seed = 1;
+  bool periods = false;
+  bool verbose = false;
+  const char *out_path = NULL;
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "t:g:m:w:s:r:o:pv"))) {
+    switch (opt) {
+      case 't': tolerances.push_back(atoi(optarg)); break;
+      case 'g': max_gears = atoi(optarg); break;
+      case 'm': min_speedo = atoi(optarg); break;
+      case 'w': window_ms = atol(optarg); break;
+      case 's': seconds = atol(optarg); break;
+      case 'r': seed = atol(optarg); break;
+      case 'o': out_path = optarg; break;
+      case 'p': periods = true; break;
+      case 'v': verbose = true; break;
+      default: usage();
+    }
+  }
+  if ((argc - optind > 1) || (0 == max_gears) || (max_gears > GEAR_MAX_GEARS) || (0 == window_ms))
+    usage();
+  if (tolerances.empty())
+    tolerances.push_back(DEFAULT_TOLERANCE);
+
+  std::vector<Sample> samples;
+  bool labelled = true;
+  if (argc > optind) {
+    if (!read_trace(argv[optind], &samples, &labelled)) {
+      fprintf(stderr, "could not read %s\n", argv[optind]);
+      return 1;
+    }
+  }
+  else {
+    Ride ride(seed);
+    ride.make(seconds, &samples);
+    if ((NULL != out_path) && !write_trace(out_path, samples)) {
+      fprintf(stderr, "could not write %s\n", out_path);
+      return 1;
+    }
+  }
+  std::vector<Window> windows = make_windows(samples, window_ms, periods);
+  printf("%zu samples%s, %s\n", samples.size(), labelled ? " labelled" : "",
+    periods ? "timed edge by edge" : "in windows");
+  for (size_t ctr = 0; ctr < tolerances.size(); ctr++)
+    replay(windows, labelled, periods, tolerances[ctr], max_gears, min_speedo, verbose);
+  return 0;
+}
@@ -1,123 +1,66 @@
+// build with: g++ -I../sketchbook/libraries/GearClassifier/src test.cc ../sketchbook/libraries/GearClassifier/src/*.cpp
 #include <stdio.h>
 #include <string.h>
-#include "test.h"
+#include "test.h"
+#include "GearClassifier.h"
+#include "GearFilter.h"
 
-const short RATIO_TOLERANCE = 200;  // absolute - unitless
+const unsigned int RATIO_TOLERANCE = 50;  // parts per thousand either side of a known ratio
+const byte LEARN_WINDOWS = 6;  // windows at a steady ratio it takes to learn it
 
-byte MAX_GEARS = 9;
-
-// store the ratios multiplied by 1000 so we don't need floats
-unsigned short ratios[9] = {65535, 65535, 65535, 65535, 65535, 65535, 65535, 65535, 65535};
-byte num_ratios = 0;
+byte MAX_GEARS = 9;
 
-void save_to_eeprom() {
-  /* Save the ratio table in RAM to EEPROM
+// the ratios are stored multiplied by 1000 so we don't need floats
+GearClassifier classifier(RATIO_TOLERANCE, MAX_GEARS);
+
+byte update_gear_table(float ratio) {
+  /* Hold a ratio steady for long enough to learn it, as riding in a gear
+  would, and return the gear it ends up as.
   */
-}
+  for (byte ctr = 0; ctr < LEARN_WINDOWS; ctr++)
+    classifier.update(ratio * 1000 + 0.5, 1000);
+  return classifier.classify(ratio * 1000 + 0.5, 1000);
+}
 
-byte search_array(unsigned short new_ratio) {
-  /* It wasn't the first one and it wasn't bigger than the biggest, so where is it?
+byte noisy_window(float ratio) {
+  /* A single window at an odd ratio, like clutch slip or a glitch gives
   */
-  // find the first time it's smaller than a ratio's upper limit
-  byte lower_match = MAX_GEARS;
-  // loop through the ratios we know about and see where this new one fits in
-  for (byte ctr = 0; ctr < num_ratios; ctr++) {
-    short this_ratio = ratios[ctr];
-    unsigned short this_ratio_upper_limit = this_ratio + RATIO_TOLERANCE;
-    unsigned short this_ratio_lower_limit = this_ratio - RATIO_TOLERANCE;
-    // find it a new home
-    if ((new_ratio > this_ratio_lower_limit) && (new_ratio <= this_ratio_upper_limit))
-      return MAX_GEARS;  // it matches this one, do nothing
-    else if (new_ratio < this_ratio_lower_limit) {
-      lower_match = ctr;  // it's smaller than this one
-      break;
-    }
-    else if (new_ratio > this_ratio_upper_limit) {
-      // it's bigger than this one, so carry on looking
-    }
-  }
-  if (MAX_GEARS == lower_match) {
-    // this should never happen
-    printf("=======================================================\n");
-    printf("ERROR: could not find a place for new ratio: %i\n", new_ratio);
-    printf("=======================================================\n");
-    return MAX_GEARS;
-  }
-  return lower_match;
-}
-
-void insert_new_ratio(byte new_gear, unsigned short new_ratio) {
-  /* Given a new ratio with a new position, but it in the array in RAM
-  */
-  if (MAX_GEARS <= new_gear)
-    return;
-  unsigned short old_ratios[MAX_GEARS];
-  memcpy(old_ratios, ratios, MAX_GEARS*sizeof(ratios[0]));
-  // lower chunk has already been copied above
-  // move the upper chunk up to make room for the new value
-  for(byte ctr = new_gear + 1; ctr < MAX_GEARS; ctr++)
-    ratios[ctr] = old_ratios[ctr - 1];
-  ratios[new_gear] = new_ratio;
-  num_ratios++;
-  save_to_eeprom();
-}
+  return classifier.update(ratio * 1000 + 0.5, 1000);
+}
 
-byte update_gear_table(float ratio) {
-  /* Given a new ratio, find out where it should be in the list.
+/****************************************************************************************************
+  TEST CODE BELOW
+****************************************************************************************************/
+
+void print_ratios(void) {
+  /* Print the ratios in RAM
   */
-  // do we have all of them already?
-  if (num_ratios >= MAX_GEARS)
-    return MAX_GEARS;
-  // otherwise find out where to put this one
-  unsigned short new_ratio = ratio * 1000;
-  byte new_gear = MAX_GEARS;
-  if (0 == num_ratios)
-    new_gear = 0;  // it's the first one
-  else if (new_ratio > (ratios[num_ratios - 1] + RATIO_TOLERANCE))
-    new_gear = num_ratios;  // it's bigger than the current biggest one
-  else
-    new_gear = search_array(new_ratio);  // it's somewhere else
-  // update the ratio table as required
-  if (new_gear < MAX_GEARS)
-    insert_new_ratio(new_gear, new_ratio);
-  return new_gear;
-}
-
-/****************************************************************************************************
-  TEST CODE BELOW
-****************************************************************************************************/
-
-void print_ratios(void) {
-  /* Print the ratios in RAM
-  */
   printf("ratios[");
   for(int ctr=0; ctr < 9; ctr++)
-    printf("%i, ", ratios[ctr]);
+    printf("%i, ", classifier.get_ratio(ctr));
   printf("]\n");
-}
+}
 
-void reset_ratios(void) {
-  /* Reset all the ratios currently stored in RAM.
-  Does NOT change EEPROM.
+void reset_ratios(void) {
+  /* Reset all the ratios currently stored in RAM.
+  Does NOT change EEPROM.
   */
-  for (byte ctr = 0; ctr < MAX_GEARS; ctr++)
-    ratios[ctr] = 65535;
-  num_ratios = 0;
+  classifier.reset();
 }
-
-void compare_to_expected(unsigned short *expected_ratios, byte num_expected) {
-  /* Compare the ratios in RAM to a list of expected ratios.
+
+void compare_to_expected(unsigned short *expected_ratios, byte num_expected) {
+  /* Compare the ratios in RAM to a list of expected ratios.
   */
-  byte errors = 0;
+  byte errors = (classifier.num_gears() != num_expected);
   for (byte ctr = 0; ctr < num_expected; ctr++) {
-    if (ratios[ctr] != expected_ratios[ctr])
+    if (classifier.get_ratio(ctr) != expected_ratios[ctr])
       errors++;
   }
   if (errors > 0) {
     printf("ERRORS:\n");
     print_ratios();
   }
-}
+}
 
 void test1(void) {
   printf("Test 1\n");
@@ -154,10 +97,10 @@ void test3(void) {
   update_gear_table(3.5);
   update_gear_table(4.5);
   update_gear_table(3.5);
-  update_gear_table(2.7);  // 2.5 with noise
+  noisy_window(2.7);  // 2.5 with noise
   update_gear_table(3.5);
   update_gear_table(3.5);
-  update_gear_table(1.4);
+  noisy_window(1.4);
   unsigned short expected[] = {500, 1500, 2500, 3500, 4500};
   compare_to_expected(expected, 5);
 }
@@ -177,13 +120,170 @@ void test4(void) {
   compare_to_expected(expected, 8);
 }
 
-int main(void) {
-  /* Run a couple of tests to exercise the search functions.
+void test5(void) {
+  printf("Test 5\n");
+  // the edges of a ratio's tolerance, with counts that would overflow if not scaled down
+  GearClassifier classifier(50);
+  unsigned short table[] = {1000, 2000};
+  classifier.set_ratios(table, 2);
+  unsigned int counts[][3] = {{1050, 1000, 0}, {950, 1000, GEAR_NONE}, {951, 1000, 0}, {1051, 1000, GEAR_NONE},
+    {2100, 1000, 1}, {1901, 1000, 1}, {1900, 1000, GEAR_NONE}, {60000, 40000, GEAR_NONE}, {60000, 30000, 1},
+    {0, 1000, GEAR_NONE}, {1000, 0, GEAR_NONE}};
+  for (unsigned int ctr = 0; ctr < sizeof(counts) / sizeof(counts[0]); ctr++) {
+    byte gear = classifier.classify(counts[ctr][0], counts[ctr][1]);
+    if (gear != counts[ctr][2])
+      printf("ERROR: tacho(%u) speedo(%u) gave gear %u, not %u\n", counts[ctr][0], counts[ctr][1], gear, counts[ctr][2]);
+  }
+}
+
+void test6(void) {
+  printf("Test 6\n");
+  // multiplying out has to agree with dividing, every time
+  GearClassifier classifier(50);
+  unsigned short table[] = {500, 1500, 2500, 3500, 4500, 5500};
+  classifier.set_ratios(table, 6);
+  unsigned long errors = 0;
+  for (unsigned int speedo = 1; speedo <= 300; speedo++) {
+    for (unsigned int tacho = 1; tacho <= 1800; tacho++) {
+      byte expected = GEAR_NONE;
+      for (byte ctr = 0; (ctr < 6) && (GEAR_NONE == expected); ctr++) {
+        long long scaled = (long long)tacho * 1000 * 1000;
+        if ((scaled > (long long)table[ctr] * 950 * speedo) && (scaled <= (long long)table[ctr] * 1050 * speedo))
+          expected = ctr;
+      }
+      if (classifier.classify(tacho, speedo) != expected)
+        errors++;
+    }
+  }
+  if (errors > 0)
+    printf("ERROR: %lu counts classified differently to dividing\n", errors);
+}
+
+void test7(void) {
+  printf("Test 7\n");
+  // learn the gears from noisy counts, in a muddled order
+  GearClassifier classifier(50);
+  unsigned int counts[][2] = {{303, 100}, {150, 100}, {298, 100}, {900, 300}, {410, 100}, {51, 100}, {404, 101},
+    {249, 100}, {2500, 1000}, {49, 100}, {548, 100}};
+  for (unsigned int ctr = 0; ctr < sizeof(counts) / sizeof(counts[0]); ctr++) {
+    if (GEAR_NONE == classifier.classify(counts[ctr][0], counts[ctr][1]))
+      classifier.add_ratio(counts[ctr][0], counts[ctr][1]);
+  }
+  unsigned short expected[] = {510, 1500, 2490, 3030, 4100, 5480};
+  byte errors = (6 != classifier.num_gears());
+  for (byte ctr = 0; ctr < 6; ctr++)
+    errors += (classifier.get_ratio(ctr) != expected[ctr]);
+  if (errors > 0) {
+    printf("ERRORS:\nratios[");
+    for (byte ctr = 0; ctr < classifier.num_gears(); ctr++)
+      printf("%i, ", classifier.get_ratio(ctr));
+    printf("]\n");
+  }
+}
+
+void test8(void) {
+  printf("Test 8\n");
+  // gears too far apart for the lookup table are still found
+  GearClassifier classifier(50);
+  unsigned short table[] = {100, 1000, 60000};
+  classifier.set_ratios(table, 3);
+  unsigned int counts[][3] = {{10, 100, 0}, {1000, 1000, 1}, {60000, 1000, 2}, {3000, 1000, GEAR_NONE}};
+  for (unsigned int ctr = 0; ctr < sizeof(counts) / sizeof(counts[0]); ctr++) {
+    byte gear = classifier.classify(counts[ctr][0], counts[ctr][1]);
+    if (gear != counts[ctr][2])
+      printf("ERROR: tacho(%u) speedo(%u) gave gear %u, not %u\n", counts[ctr][0], counts[ctr][1], gear, counts[ctr][2]);
+  }
+}
+
+void test9(void) {
+  printf("Test 9\n");
+  // clutch slip sweeping through the ratios isn't learned, holding one is
+  reset_ratios();
+  for (unsigned int ctr = 0; ctr < 40; ctr++)
+    noisy_window(1.0 + ctr * 0.05);
+  if (0 != classifier.num_gears())
+    printf("ERROR: learned %u gears from clutch slip\n", classifier.num_gears());
+  update_gear_table(2.0);
+  unsigned short expected[] = {2000};
+  compare_to_expected(expected, 1);
+  if (!classifier.take_changed() || classifier.take_changed())
+    printf("ERROR: learning a gear should flag the table as changed, once\n");
+}
+
+void test10(void) {
+  printf("Test 10\n");
+  // a ratio learned a bit off moves towards where the windows say it is
+  reset_ratios();
+  update_gear_table(2.5);
+  for (unsigned int ctr = 0; ctr < 4 * GEAR_REFINE_MS / GEAR_UPDATE_MS; ctr++)
+    classifier.update((ctr & 1) ? 2540 : 2560, 1000);
+  unsigned short refined = classifier.get_ratio(0);
+  if ((1 != classifier.num_gears()) || (refined <= 2525) || (refined > 2550))
+    printf("ERROR: refined ratio(%u)\n", refined);
+}
+
+void test11(void) {
+  printf("Test 11\n");
+  // ride through a spike, a shift, the edge of a gear and a stop
+  GearClassifier gear_classifier(50);
+  unsigned short table[] = {1000, 1500, 2500};
+  gear_classifier.set_ratios(table, 3);
+  GearFilter filter(&gear_classifier, 3);
+  unsigned int windows[][3] = {{300, 200, 1}, {300, 200, 1}, {500, 200, 1}, {300, 200, 1},  // a spike
+    {150, 200, 1}, {120, 200, 1}, {500, 200, 2}, {500, 200, 2},  // clutch in, shift up
+    {530, 200, 2}, {500, 200, 2},  // past the gear's tolerance, but not by enough to leave it
+    {200, 200, 2}, {200, 200, 2}, {200, 200, 0}, {200, 200, 0},  // no clutch, so it has to be seen twice
+    {0, 0, 0}, {0, 1, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, GEAR_NONE}};  // stopped
+  for (unsigned int ctr = 0; ctr < sizeof(windows) / sizeof(windows[0]); ctr++) {
+    byte gear = filter.update(windows[ctr][0], windows[ctr][1], ctr * 500UL);
+    if (gear != windows[ctr][2])
+      printf("ERROR: window %u shows gear %u, not %u\n", ctr, gear, windows[ctr][2]);
+  }
+}
+
+void test12(void) {
+  printf("Test 12\n");
+  // updates once per speedo period, as PERIOD_DETECTION does, so a coast is dozens of updates
+  const float SPEEDO_HZ = 40;  // riding along
+  const float IDLE_RATIO = 25 / SPEEDO_HZ;  // the tacho at idle over the speedo, clutch in
+  GearClassifier gear_classifier(RATIO_TOLERANCE);
+  GearFilter filter(&gear_classifier, 3);
+  unsigned long time_now = 0;
+  for (; time_now < 10000; time_now += 1000 / SPEEDO_HZ)
+    filter.update(2000, 1000, time_now);
+  if (1 != gear_classifier.num_gears())
+    printf("ERROR: learned %u gears riding in one\n", gear_classifier.num_gears());
+  for (unsigned int coast_ms = 1000; coast_ms <= 5000; coast_ms += 1000) {
+    // clutch in and slowing, 6% of the speed a second, then back in gear
+    unsigned long coast_start = time_now;
+    float speedo_hz = SPEEDO_HZ;
+    for (; time_now - coast_start < coast_ms; time_now += 1000 / speedo_hz) {
+      speedo_hz = SPEEDO_HZ * (1 - 0.06 * (time_now - coast_start) / 1000);
+      filter.update(IDLE_RATIO * SPEEDO_HZ / speedo_hz * 1000 + 0.5, 1000, time_now);
+    }
+    byte gear = GEAR_NONE;
+    for (coast_start = time_now; time_now - coast_start < 1000; time_now += 1000 / SPEEDO_HZ)
+      gear = filter.update(2000, 1000, time_now);
+    if ((1 != gear_classifier.num_gears()) || (0 != gear))
+      printf("ERROR: a %u ms coast left %u gears, showing gear %u\n", coast_ms, gear_classifier.num_gears(), gear);
+  }
+}
+
+int main(void) {
+  /* Run a couple of tests to exercise the search functions.
   */
   printf("Starting tests...\n\n");
   test1();
   test2();
   test3();
   test4();
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
   printf("\ndone.\n");
 }
@@ -1,395 +1,1195 @@
-#define DEBUG_LOGGING
-
-#include <WinbondFlash.h>
-#include <StubFlash.h>
-#include <DebouncedButton.h>
-
-// constants for this hardware flash logger
-const byte TACH_INTERRUPT_PIN = 2;
-const byte SPEEDO_INTERRUPT_PIN = 3;
-const int ADC_NEUTRAL_PIN = A0;
-//const short UPDATE_RATE = 100;  // milliseconds - 10 Hz
-const int UPDATE_RATE = 2000;
-const short LED_RATE_LOGGING = UPDATE_RATE;
-const short LED_RATE_ALIVE = 500;
-const short LED_RATE_ERASING = 50;
-const byte BUTTON_PIN = 7;
-const byte LED_PIN = 6;  // need a 150ohm current limiting resistor
-const byte SPI_CLK = 13;
-const byte SPI_MOSI = 11;
-const byte SPI_MISO = 12;
-const byte SPI_CS = 10;
-const byte DEBOUNCE_TIME = 20;
-const short SHORT_PRESS = 1000;
-const short LONG_PRESS = 5000;
-const byte RECORD_BYTES = 10;
-const byte FILE_HEADER_MAGIC_BYTES[] = {0xbe, 0xeb, 0xee, 0x1a, 0x2b, 0x3c, 0xee, 0x77};
-const byte FILE_FORMAT_VERSION = 1;
-
-// globals - cos arduinos seem to work like this
-volatile byte logging_enabled = 0;
-volatile byte erase_flag = 0;
-unsigned int ctr_tacho = 0;
-unsigned int ctr_speedo = 0;
-volatile int last_tacho;
-volatile int last_speedo;
-unsigned long update_data_time = 0;
-unsigned long led_time = 0;
-unsigned int adc_neutral = 0;
-
-//WinbondFlash flash(SPI_CS, 64);
-StubFlash flash;
-
-DebouncedButton button(BUTTON_PIN, DEBOUNCE_TIME);
-
-char debug_string[200];
-
- /* File system */
-struct DataRecord {
-  unsigned long ctr_record;  // this is normally the millis() of the device
-  unsigned int ctr_tacho;
-  unsigned int ctr_speedo;
-  unsigned int adc_neutral;
-  byte check_byte;
-};
-
-struct FileHeader {  // 32 bytes total
-  // FILE_HEADER_MAGIC_BYTES - 8 bytes
-  byte record_version;
-  byte record_len;
-  byte future_use[21];
-  byte check_byte;
-};
-
-unsigned char FILE_HEADER_MAGIC_LEN = 8;
-unsigned char FILE_HEADER_LEN = 24;
-unsigned char FILE_HEADER_TOTAL_LEN = 32;
-
-/* /File system */
-
-class Foo {
-  public:
-    Foo();
-};
-
-void setup() {
-  /* This is run once at startup
-  */
-  noInterrupts();
-  flash.debug_string = debug_string;
-  button.debug_string = debug_string;
-  Serial.begin(115200);
-  analogReference(DEFAULT);
-  attachInterrupt(digitalPinToInterrupt(TACH_INTERRUPT_PIN), isr_tacho, RISING);
-  attachInterrupt(digitalPinToInterrupt(SPEEDO_INTERRUPT_PIN), isr_speedo, RISING);
-  pinMode(BUTTON_PIN, INPUT_PULLUP);
-  pinMode(LED_PIN, OUTPUT);
-  flash_init();
-  interrupts();
-}
-
-void loop() {
-  /* The main loop that the arduino uses for running
-  */
-  unsigned long now = millis();
-  check_push_button(now);
-  flash_erase();
-  update_data(now);
-  update_status_led(now);
-  check_serial_commands();
-}
-
-void check_push_button(unsigned long time_now) {
-  /* Check the button to see it it's transitioned from high to low
-  */
-  button.read(time_now);
-  if ((0 != button.get_press_time()) && button.is_pressed()) {
-    // the button is held down and we're counting
-    if (time_now > button.get_press_time() + LONG_PRESS) {
-      erase_flag = 1;
-      logging_enabled = 0;
-      #ifdef DEBUG_LOGGING
-      Serial.println("long_press");
-      #endif
-    }
-    else if (time_now > button.get_press_time() + SHORT_PRESS) {
-      logging_enabled = 1;
-      #ifdef DEBUG_LOGGING
-      Serial.println("short_press");
-      #endif
-    }
-  }
-}
-
-void update_status_led(unsigned long time_now) {
-  /* Update the status LED based on what the board is doing
-  */
-  if (time_now >= led_time) {
-    unsigned int led_rate = (1 == logging_enabled) ? LED_RATE_LOGGING : LED_RATE_ALIVE; 
-    led_time = time_now + led_rate;
-    digitalWrite(LED_PIN, !digitalRead(LED_PIN));
-    #ifndef DEBUG_LOGGING
-    Serial.println("I'm alive.");
-    #endif
-  }
-}
-
-void update_data(unsigned long time_now) {
-  /* Update the data if it is time to do so
-  */
-  if (time_now >= update_data_time) {
-    update_data_time = time_now + UPDATE_RATE;
-    update_counters();
-    update_neutral();
-    save_to_flash(time_now);
-  }
-}
-
-void check_serial_commands(void) {
-  /* Dump all the data in the EEPROM to the serial port
-  */
-  if(Serial.available() > 4) {
-    Serial.setTimeout(UPDATE_RATE);
-    String str = Serial.readStringUntil('\n');
-    if(str.substring(0) == "dump")
-      dump_data_to_serial();
-    else if(str.substring(0) == "query")
-      flash_chip_query();
-    else if (str.substring(0) == "erase_flash")
-      erase_flag = 1;
-    else if (str.substring(0) == "init_flash")
-      flash.init();
-    else if (str.substring(0) == "test_flash")
-      flash.test_flash();
-  }
-}
-
-void dump_data_to_serial(void) {
-  /* Dump all the data in the EEPROM to the serial port
-  */
-  Serial.println("Printing all flash data to serial.");
-}
-
-void update_neutral(void) {
-  /* Read the ADC value for the neutral pin 
-  */
-  adc_neutral = analogRead(ADC_NEUTRAL_PIN);
-}
-
-void update_counters(void) {
-  /* Update the counters and write them to EEPROM
-  */
-  last_tacho = ctr_tacho;
-  last_speedo = ctr_speedo;
-  ctr_tacho = 0;
-  ctr_speedo = 0;
-}
-
-void isr_tacho() {
-  /* Just increment the tacho counter
-  */
-  ctr_tacho++;
-}
-
-void isr_speedo() {
-  /* Just increment the speedo counter
-  */
-  ctr_speedo++;
-}
-
-/* push button *********************************************************************/
-
-
-
-/* /push button *********************************************************************/
-
-/* flash *********************************************************************/
-
-unsigned long find_header(unsigned long start_address=0) {
-  /* Find a file header, starting from the current address
-  */
-  FileHeader header;
-  for (unsigned long address = start_address; address < flash.len_bytes - FILE_HEADER_TOTAL_LEN; address++) {
-    if(read_file_header(address, &header))
-      return address;
-  }
-  return 0xffffffff;
-}
-
-unsigned long find_write_location(unsigned long start_address=0) {
-  /* Find the next write-location that is at least HEADER_LEN bytes long
-  */
-  unsigned long write_location = 0xffffffff;
-  for (unsigned long address = start_address; address < flash.len_bytes - FILE_HEADER_TOTAL_LEN; address++) {
-    // read a header's worth from the flash
-    byte data[FILE_HEADER_TOTAL_LEN];
-    flash.read_data(address, data, FILE_HEADER_TOTAL_LEN);
-    // walk through it counting any byte that isn't 0xff
-    byte offset = 0;
-    while((0xff == data[offset]) && (offset < FILE_HEADER_TOTAL_LEN))
-      offset++;  // slower than a memcmp but a but more mem efficient
-    // was there a whole block of 0xff?
-    if (FILE_HEADER_TOTAL_LEN == offset) {
-      write_location = address;
-      break;
-    }
-  }
-  return write_location;
-}
-
-void flash_init(void) {
-  /* Set up the flash filesystem
-  */
-  flash.init();
-
-  unsigned long header_location = find_header(0);
-  sprintf(debug_string, "found header: %lu", header_location);
-  Serial.println(debug_string);
-
-  find_write_location();
-
-  // check file header functionality
-  write_file_header();
-
-  header_location = find_header(0);
-  sprintf(debug_string, "found header: %lu", header_location);
-  Serial.println(debug_string);
-
-  find_write_location();
-  
-  FileHeader header;
-  bool header_ok = read_file_header(0, &header);
-  sprintf(debug_string, "header: ok(%1u) ver(%u) reclen(%u) x(0x%02x)", header_ok, header.record_version, header.record_len, header.check_byte);
-  Serial.println(debug_string);
-  
-//  DataRecord record_one;
-//  record_one.ctr_record = 11;
-//  record_one.ctr_tacho = 22;
-//  record_one.ctr_speedo = 33;
-//  record_one.adc_neutral = 44;
-//
-//  write_record(&record_one);
-//
-//  byte some_data[256];
-//  flash.read_data(0, some_data, 256);
-//  print_data_array_256(some_data);
-//
-//  DataRecord record_from_flash;
-//
-//  bool res = read_record(0, &record_from_flash);
-//  print_record(&record_from_flash);
-//  Serial.println(res);
-}
-
-void save_to_flash(unsigned long time_now) {
-  /* Save the latest values to the flash chip
-  */
-  DataRecord record;
-  record.ctr_record = time_now;
-  record.ctr_tacho = last_tacho;
-  record.ctr_speedo = last_speedo;
-  record.adc_neutral = adc_neutral;
-  if (1 == logging_enabled)
-    write_record(&record);  // this calculates the CRC before writing
-  #ifdef DEBUG_LOGGING
-  print_record(&record);
-  #endif
-}
-
-void flash_erase(void) {
-  /* Erase the flash chip if the flag is set
-  */
-  if (!erase_flag) 
-    return;
-  erase_flag = 0;
-  flash.erase_chip();
-}
-
-void flash_chip_query(void) {
-  /* query the flash chip for info and print it to serial
-  */
-  byte flash_info[] = {0,0,0,0,0,0};
-  flash.read_flash_info(flash_info);
-  sprintf(debug_string, "flash_info: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x", 
-    flash_info[0], flash_info[1], flash_info[2], flash_info[3], flash_info[4], flash_info[5]);
-  Serial.println(debug_string);
-}
-
-/* \flash **********************************************************************/
-
-void write_file_header(void) {
-  /* Write the file header to flash
-  */
-  byte header_data[FILE_HEADER_TOTAL_LEN];
-  for(byte ctr = 0; ctr < FILE_HEADER_TOTAL_LEN; ctr++)
-    header_data[ctr] = 0xff;
-  FileHeader header;
-  header.record_version = FILE_FORMAT_VERSION;
-  header.record_len = sizeof(DataRecord);
-  memcpy(&header_data, FILE_HEADER_MAGIC_BYTES, FILE_HEADER_MAGIC_LEN);
-  memcpy(&header_data[FILE_HEADER_MAGIC_LEN], &header, FILE_HEADER_LEN);
-  header.check_byte = calculate_crc((byte*)&header_data, FILE_HEADER_TOTAL_LEN - 1);
-  header_data[FILE_HEADER_TOTAL_LEN - 1] = header.check_byte;
-  flash.write_data(header_data, sizeof(header_data));
-}
-
-bool read_file_header(unsigned long address, FileHeader *header) {
-  /* Read a file header from flash, checking the magic bytes and checksum
-  */
-  byte header_data[FILE_HEADER_TOTAL_LEN];
-  for(byte ctr = 0; ctr < FILE_HEADER_TOTAL_LEN; ctr++)
-    header_data[ctr] = 0xff;
-  flash.read_data(address, header_data, FILE_HEADER_TOTAL_LEN);
-  int res = memcmp(header_data, FILE_HEADER_MAGIC_BYTES, FILE_HEADER_MAGIC_LEN);
-  memcpy(header, header_data + FILE_HEADER_MAGIC_LEN, sizeof(FileHeader));  
-  byte calculated_checkbyte = calculate_crc((byte*)&header_data, FILE_HEADER_TOTAL_LEN - 1);
-  return (0 == res) && (header->check_byte == calculated_checkbyte);
-}
-
-void print_all_records(void) {
-  /* Print all the known records to the serial port
-  */
-//  for (unsigned long read_addr = 0; read_addr < flash.len_bytes - RECORD_BYTES; read_addr+=RECORD_BYTES) {
-//    DataRecord record;
-//    bool res = read_record(read_addr, &record);
-//    if ((0xff == record.record_version) || (0 == res))
-//      break;
-//    print_record(&record);
-//  }
-}
-
-byte calculate_crc(byte *data, byte len) {
-  /* Calculate the XOR checksum of the given data
-  */
-  byte checksum = 0;
-  for (byte ctr = 0; ctr < len; ctr++)
-    checksum ^= data[ctr];
-  return checksum;
-}
-
-void write_record(DataRecord *record) {
-  /* Write a record to flash, updating the check_byte before saving
-  */
-  byte *record_data = (byte*)record;
-  record->check_byte = calculate_crc(record_data, sizeof(DataRecord) - 1);
-  flash.write_data(record_data, sizeof(DataRecord));
-}
-
-bool read_record(unsigned long address, DataRecord *record) {
-  /* Read a record from the specified flash location
-  */
-  byte *record_data = (byte*)record;
-  flash.read_data(address, record_data, sizeof(DataRecord));
-  byte check_byte = calculate_crc(record_data, sizeof(DataRecord) - 1);
-  return (check_byte == record->check_byte);
-}
-
-void print_record(DataRecord *record) {
-  /* Print a data record to the serial port
-  */
-  sprintf(debug_string, "ctr(%lu) t(%u) s(%u) n(%u) x(0x%02x)",
-    record->ctr_record, record->ctr_tacho, record->ctr_speedo, record->adc_neutral, record->check_byte);
-  Serial.println(debug_string);
-}
-
-// end
+#define DEBUG_LOGGING
+//#define COMPRESS_BLOCKS  // LZ compress each packed block on its way to flash, at the cost of a longest-match search per block
+
+#include <EEPROM.h>
+#include <WinbondFlash.h>
+#include <StubFlash.h>
+#include <SessionDirectory.h>
+#include <CommitMarker.h>
+#include <DebouncedButton.h>
+
+// constants for this hardware flash logger
+const byte TACH_INTERRUPT_PIN = 2;
+const byte SPEEDO_INTERRUPT_PIN = 3;
+const int ADC_NEUTRAL_PIN = A0;
+//const short UPDATE_RATE = 100;  // milliseconds - 10 Hz
+const int UPDATE_RATE = 2000;  // the sample period at startup, the rate and period commands change it
+const unsigned int MIN_SAMPLE_PERIOD = 1;  // milliseconds, 1 kHz
+const unsigned int MAX_SAMPLE_PERIOD = 4000;  // the most Timer1 can count with its biggest prescaler
+const short LED_RATE_LOGGING = UPDATE_RATE;
+const short LED_RATE_ALIVE = 500;
+const short LED_RATE_ERASING = 50;
+const byte BUTTON_PIN = 7;
+const byte LED_PIN = 6;  // need a 150ohm current limiting resistor
+const byte SPI_CLK = 13;
+const byte SPI_MOSI = 11;
+const byte SPI_MISO = 12;
+const byte SPI_CS = 10;
+const byte DEBOUNCE_TIME = 20;
+const short SHORT_PRESS = 1000;
+const short LONG_PRESS = 5000;
+const byte RECORD_BYTES = 10;
+const byte FILE_HEADER_MAGIC_BYTES[] = {0xbe, 0xeb, 0xee, 0x1a, 0x2b, 0x3c, 0xee, 0x77};
+const byte FILE_FORMAT_VERSION = 8;  // 1 was raw DataRecords, 2 packed blocks of deltas, 3 added edge periods, 4 sample timing, 5 commit markers, 6 compressed blocks, 7 period ranges, 8 ranges packed against the mean
+const byte PACKED_BLOCK_BYTES = 128;  // the most a packed block can be, check byte included - bigger blocks repeat the first record less
+const byte PACKED_BLOCK_MARKER = 0xb2;
+const byte COMPRESSED_BLOCK_MARKER = 0xb3;
+const byte COMPRESSED_BLOCK_OVERHEAD = 3;  // marker, length and check byte
+const byte PACKED_BLOCK_HEADER_BYTES = 23;  // marker, record count and the first record up to sample_latency
+const unsigned int PACKED_TIME = 0x01;  // bits in a packed record's mask, set if that field has a delta
+const unsigned int PACKED_TACHO = 0x02;
+const unsigned int PACKED_SPEEDO = 0x04;
+const unsigned int PACKED_NEUTRAL = 0x08;
+const unsigned int PACKED_TACHO_PERIOD = 0x10;
+const unsigned int PACKED_SPEEDO_PERIOD = 0x20;
+const unsigned int PACKED_SAMPLES_MISSED = 0x40;
+const unsigned int PACKED_SAMPLE_LATENCY = 0x80;
+const unsigned int PACKED_TACHO_RANGE = 0x100;  // then 0x200 and 0x400, the min, max and last tacho period
+const unsigned int PACKED_SPEEDO_RANGE = 0x800;  // and 0x1000 and 0x2000
+const byte PACKED_FIELDS = 14;
+const byte COMMIT_RECORDS = 32;  // records written to flash before a commit marker
+const unsigned int COMMIT_BYTES = 256;  // or flash bytes, which bounds the search for the last marker at boot
+const unsigned int COMMIT_SEARCH_BYTES = COMMIT_BYTES + PACKED_BLOCK_BYTES + COMMIT_MARKER_BYTES;
+const byte EDGE_RING_LEN = 16;  // edge timestamps buffered per input, a power of two
+const byte ERASE_AHEAD_SECTORS = 2;  // 4k sectors kept erased ahead of the data, so logging never stops for an erase
+const byte ERASE_USED = 1;  // erase_flag values, the sectors written so far
+const byte ERASE_ALL = 2;  // or the whole chip
+const byte DUMP_CHUNK_BYTES = 128;  // flash read per dump frame
+const unsigned long SERIAL_BAUD = 115200;
+const unsigned long DUMP_BAUDS[] = {115200, 230400, 250000, 500000, 1000000, 2000000};
+const int EEPROM_WRITE_HINT_ADDRESS = 0;  // two bytes, the flash sector last written to
+const byte RECORD_QUEUE_LEN = 4;  // records in each half of the record queue
+const unsigned int DRAIN_BUDGET_MICROS = 2000;  // how long a loop pass can spend writing queued records
+
+// globals - cos arduinos seem to work like this
+volatile byte logging_enabled = 0;
+volatile byte erase_flag = 0;
+byte erasing = 0;
+byte logging_session = 0;  // what logging_enabled was the last time the session was updated
+volatile unsigned int ctr_tacho = 0;
+volatile unsigned int ctr_speedo = 0;
+unsigned int sample_period = UPDATE_RATE;  // milliseconds between Timer1 sample ticks
+unsigned int session_period = UPDATE_RATE;  // the sample period in the open session's header
+// set by the sample clock ISR, read by the main loop with interrupts off
+volatile byte sample_due = 0;
+volatile unsigned long sample_time;  // millis() at the tick
+volatile unsigned long sample_micros;  // micros() at the tick, to measure latency from
+volatile unsigned int sample_tacho;
+volatile unsigned int sample_speedo;
+volatile byte samples_missed = 0;  // ticks the main loop didn't get to before the next one
+unsigned int max_latency = 0;  // the worst sample latency this session
+unsigned long led_time = 0;
+unsigned int adc_neutral = 0;
+unsigned int write_hint = FLASH_NO_WRITE_HINT;
+volatile byte edge_capture = 0;  // timestamp every tacho and speedo edge, not just count them
+
+//WinbondFlash flash(SPI_CS, 64);
+StubFlash flash;
+SessionDirectory directory(&flash);
+
+DebouncedButton button(BUTTON_PIN, DEBOUNCE_TIME);
+
+char debug_string[100];
+
+ /* File system */
+struct DataRecord {
+  unsigned long ctr_record;  // this is normally the millis() of the device
+  unsigned int ctr_tacho;
+  unsigned int ctr_speedo;
+  unsigned int adc_neutral;
+  unsigned long tacho_period;  // microseconds between edges over the sample, zero if not captured
+  unsigned long speedo_period;
+  byte samples_missed;  // sample ticks skipped before this one, because the loop was late
+  unsigned int sample_latency;  // microseconds from the tick to this record being made
+  unsigned int tacho_spread[3];  // microseconds, the mean period less the shortest, the longest less the mean and the last less the shortest, at most 0xffff
+  unsigned int speedo_spread[3];
+  byte check_byte;
+};
+
+/* Edge capture:
+  Each ISR pushes micros() for its edge onto a ring. Only the ISR moves the
+  head and only the main loop moves the tail, both single bytes, so neither
+  side needs interrupts off. The main loop drains the rings every pass and
+  works out the mean period over each sample, which resolves low pulse
+  rates far better than the count does, and the shortest, longest and last
+  single period, so a shift or a misfire shows up without sampling faster.
+  An edge is dropped, and counted, if the ring is full.
+*/
+struct EdgeRing {
+  volatile unsigned long edges[EDGE_RING_LEN];
+  volatile byte head;
+  volatile byte tail;
+  volatile byte overflows;
+  // only used by the main loop
+  byte seen_overflows;
+  bool timing;  // is window_start a real edge yet?
+  unsigned long window_start;  // the last edge of the sample before
+  unsigned long last_edge;
+  unsigned int window_edges;  // edges since window_start
+  unsigned long period_min;  // of the single periods since window_start
+  unsigned long period_max;
+  unsigned long period_last;
+};
+
+EdgeRing tacho_edges;
+EdgeRing speedo_edges;
+
+/* Record queue:
+  Sampling puts records into one half of the queue while the main loop
+  writes the other half to flash, a few at a time under DRAIN_BUDGET_MICROS,
+  so a slow flash write never holds up a sample. The halves swap when the
+  one being written is empty. If sampling fills its half first, the record
+  is dropped and counted.
+*/
+DataRecord record_queue[2][RECORD_QUEUE_LEN];
+byte queue_filling = 0;  // the half sampling puts records into, the other is being written
+byte queue_len[2] = {0, 0};
+byte queue_written = 0;  // records written so far from the half being written
+unsigned int queue_overflows = 0;
+
+struct FileHeader {  // 32 bytes total
+  // FILE_HEADER_MAGIC_BYTES - 8 bytes
+  byte record_version;
+  byte record_len;  // for packed records, the most bytes in a block
+  unsigned int sample_period;  // milliseconds, what packed time deltas are relative to
+  byte future_use[19];
+  byte check_byte;
+};
+
+/* Packed blocks, FILE_FORMAT_VERSION 8:
+  PACKED_BLOCK_MARKER, record count, then the first record in full up to
+  sample_latency. Every record after that is a mask saying which fields
+  changed, then a zig-zag varint delta for each of those fields. The time
+  delta is relative to the sample period. The mask's top bit says a second
+  byte follows, with the bits for the period ranges. These aren't deltas
+  from the record before: each is the record's own mean period less its
+  shortest, its longest less the mean, and its last less its shortest, in
+  microseconds up to 0xffff, so they stay small, and are left out when
+  edge capture is off. The first record's ranges follow it the same way, a
+  mask with only those bits set and their varints. One XOR check byte ends
+  the block.
+  Version 2 was the same, but its records stopped at adc_neutral, and
+  version 3 stopped at speedo_period. Up to version 6 the records stopped at
+  sample_latency and the mask was one byte. Version 7 packed the ranges as
+  deltas from the record before, and the first record carried them in full.
+*/
+
+/* Compressed blocks, FILE_FORMAT_VERSION 6:
+  With COMPRESS_BLOCKS, each packed block, check byte and all, is LZ
+  compressed on its own and written as COMPRESSED_BLOCK_MARKER, the
+  compressed length, the compressed bytes, then an XOR check byte of all
+  that. A block that doesn't get smaller is written as it is. Every block
+  still decodes by itself, so any page can be read from its first marker.
+  The compressed bytes are tokens:
+    0nnnnnnn - the next n + 1 bytes are literals
+    1lllllll oooooooo - copy l + 3 bytes from o + 1 bytes back in the output
+*/
+byte packed_block[PACKED_BLOCK_BYTES];
+byte packed_len = 0;
+DataRecord packed_last;
+
+/* Commit markers, FILE_FORMAT_VERSION 5:
+  Once COMMIT_RECORDS records or COMMIT_BYTES of flash have been written in
+  packed blocks, a commit marker follows the next block, holding the records
+  written this session. CommitMarker.h has the layout. It is programmed
+  straight away, along with anything staged before it, so a marker means
+  everything before it is whole. After a power cut, only the bytes after the
+  last marker need checking.
+*/
+unsigned long session_records = 0;  // in packed blocks written to flash
+byte uncommitted_records = 0;
+unsigned long commit_address;  // the end of the last commit marker
+
+unsigned char FILE_HEADER_MAGIC_LEN = 8;
+unsigned char FILE_HEADER_LEN = 24;
+unsigned char FILE_HEADER_TOTAL_LEN = 32;
+
+/* /File system */
+
+class Foo {
+  public:
+    Foo();
+};
+
+void setup() {
+  /* This is run once at startup
+  */
+  noInterrupts();
+  flash.debug_string = debug_string;
+  directory.debug_string = debug_string;
+  button.debug_string = debug_string;
+  Serial.begin(SERIAL_BAUD);
+  analogReference(DEFAULT);
+  attachInterrupt(digitalPinToInterrupt(TACH_INTERRUPT_PIN), isr_tacho, RISING);
+  attachInterrupt(digitalPinToInterrupt(SPEEDO_INTERRUPT_PIN), isr_speedo, RISING);
+  pinMode(BUTTON_PIN, INPUT_PULLUP);
+  pinMode(LED_PIN, OUTPUT);
+  flash_init();
+  start_sample_clock(sample_period);
+  interrupts();
+}
+
+void loop() {
+  /* The main loop that the arduino uses for running
+  */
+  unsigned long now = millis();
+  check_push_button(now);
+  update_session();
+  drain_edges(&tacho_edges);
+  drain_edges(&speedo_edges);
+  flash_erase();
+  directory.update();
+  update_data();
+  drain_records(DRAIN_BUDGET_MICROS);
+  update_status_led(now);
+  check_serial_commands();
+}
+
+void check_push_button(unsigned long time_now) {
+  /* Check the button to see it it's transitioned from high to low
+  */
+  button.read(time_now);
+  if ((0 != button.get_press_time()) && button.is_pressed()) {
+    // the button is held down and we're counting
+    if (time_now > button.get_press_time() + LONG_PRESS) {
+      erase_flag = ERASE_USED;
+      logging_enabled = 0;
+      #ifdef DEBUG_LOGGING
+      Serial.println(F("long_press"));
+      #endif
+    }
+    else if (time_now > button.get_press_time() + SHORT_PRESS) {
+      logging_enabled = 1;
+      #ifdef DEBUG_LOGGING
+      Serial.println(F("short_press"));
+      #endif
+    }
+  }
+}
+
+void update_status_led(unsigned long time_now) {
+  /* Update the status LED based on what the board is doing
+  */
+  if (time_now >= led_time) {
+    unsigned int led_rate = (1 == logging_enabled) ? LED_RATE_LOGGING : LED_RATE_ALIVE;
+    if (1 == erasing)
+      led_rate = LED_RATE_ERASING;
+    led_time = time_now + led_rate;
+    digitalWrite(LED_PIN, !digitalRead(LED_PIN));
+    #ifndef DEBUG_LOGGING
+    Serial.println(F("I'm alive."));
+    #endif
+  }
+}
+
+void update_data(void) {
+  /* Make a record if the sample clock has ticked. The ISR took the counts on
+    the tick, so the loop being late only shows up as latency.
+  */
+  if (0 == sample_due)
+    return;
+  DataRecord record;
+  noInterrupts();
+  record.ctr_record = sample_time;
+  record.ctr_tacho = sample_tacho;
+  record.ctr_speedo = sample_speedo;
+  record.samples_missed = samples_missed;
+  unsigned long tick_micros = sample_micros;
+  samples_missed = 0;
+  sample_due = 0;
+  interrupts();
+  unsigned long latency = micros() - tick_micros;
+  record.sample_latency = (latency > 0xffff) ? 0xffff : latency;
+  if (record.sample_latency > max_latency)
+    max_latency = record.sample_latency;
+  update_neutral();
+  capture_record(&record);
+}
+
+void check_serial_commands(void) {
+  /* Dump all the data in the EEPROM to the serial port
+  */
+  if(Serial.available() > 4) {
+    Serial.setTimeout(UPDATE_RATE);
+    String str = Serial.readStringUntil('\n');
+    const char *command = str.c_str();  // compared against commands kept in flash rather than RAM
+    if (0 == strncmp_P(command, PSTR("dump"), 4)) {
+      // dump [offset [length [baud]]]
+      unsigned long offset = 0;
+      unsigned long length = flash.len_bytes;
+      unsigned long baud = SERIAL_BAUD;
+      sscanf_P(command, PSTR("dump %lu %lu %lu"), &offset, &length, &baud);
+      dump_data_to_serial(offset, length, baud);
+    }
+    else if (0 == strncmp_P(command, PSTR("rate "), 5)) {
+      // rate <hz>, rounded to a whole number of milliseconds
+      unsigned int rate = str.substring(5).toInt();
+      if (rate > 0)
+        set_sample_period(1000 / rate);
+    }
+    else if (0 == strncmp_P(command, PSTR("period "), 7)) {
+      // period <milliseconds>
+      set_sample_period(str.substring(7).toInt());
+    }
+    else if (0 == strcmp_P(command, PSTR("flush_flash"))) {
+      flush_records();
+      flash.flush();
+    }
+    else if (0 == strcmp_P(command, PSTR("list")))
+      directory.list();
+    else if (0 == strcmp_P(command, PSTR("stop_logging")))
+      logging_enabled = 0;
+    else if (0 == strcmp_P(command, PSTR("query")))
+      flash_chip_query();
+    else if (0 == strcmp_P(command, PSTR("erase_flash")))
+      erase_flag = ERASE_USED;
+    else if (0 == strcmp_P(command, PSTR("erase_all_flash")))
+      erase_flag = ERASE_ALL;
+    else if (0 == strcmp_P(command, PSTR("init_flash")))
+      flash_init();
+    else if (0 == strcmp_P(command, PSTR("test_flash")))
+      flash.test_flash();
+    else if (0 == strcmp_P(command, PSTR("bench_flash")))
+      flash.benchmark();
+    else if (0 == strcmp_P(command, PSTR("flash_stats")))
+      flash.print_latency();
+    else if (0 == strcmp_P(command, PSTR("reset_flash_stats")))
+      flash.reset_latency();
+    else if (0 == strcmp_P(command, PSTR("capture_on")))
+      set_edge_capture(1);
+    else if (0 == strcmp_P(command, PSTR("capture_off")))
+      set_edge_capture(0);
+  }
+}
+
+/* Binary dump protocol:
+  The host sends "dump [offset [length [baud]]]". The reply is one text line,
+  "dump(offset, length, baud)", at the normal baud rate. The port then
+  switches to the requested baud rate, if it is one of DUMP_BAUDS, and the
+  flash is streamed as frames. Each frame is COBS encoded and ends with a
+  zero byte. Decoded, it holds the address as four bytes, low byte first,
+  then up to DUMP_CHUNK_BYTES of flash, then a CRC-16/CCITT of all that,
+  low byte first. A frame with no data marks the end, and the port goes
+  back to the normal baud rate. A bad frame can be fetched again by asking
+  for a dump from its address. Sending anything during the dump stops it.
+*/
+
+void dump_data_to_serial(unsigned long offset, unsigned long length, unsigned long baud) {
+  /* Dump the flash to the serial port as framed binary chunks
+  */
+  flush_records();
+  flash.flush();
+  if ((offset > flash.len_bytes) || (length > flash.len_bytes - offset))
+    length = (offset > flash.len_bytes) ? 0 : flash.len_bytes - offset;
+  bool baud_ok = false;
+  for (byte ctr = 0; ctr < sizeof(DUMP_BAUDS) / sizeof(DUMP_BAUDS[0]); ctr++)
+    baud_ok |= DUMP_BAUDS[ctr] == baud;
+  if (!baud_ok)
+    baud = SERIAL_BAUD;
+  sprintf_P(debug_string, PSTR("dump(%lu, %lu, %lu)"), offset, length, baud);
+  Serial.println(debug_string);
+  Serial.flush();
+  Serial.begin(baud);
+  byte frame[4 + DUMP_CHUNK_BYTES + 2];
+  unsigned long end = offset + length;
+  while ((offset < end) && (0 == Serial.available())) {
+    byte chunk = (end - offset < DUMP_CHUNK_BYTES) ? end - offset : DUMP_CHUNK_BYTES;
+    memcpy(frame, &offset, 4);
+    flash.read_data(offset, frame + 4, chunk);
+    write_dump_frame(frame, 4 + chunk);
+    offset += chunk;
+  }
+  memcpy(frame, &offset, 4);
+  write_dump_frame(frame, 4);
+  Serial.flush();
+  Serial.begin(SERIAL_BAUD);
+}
+
+void write_dump_frame(byte *frame, byte len) {
+  /* Add a CRC to the frame and write it COBS encoded, so the only zero byte
+    on the wire is the one that ends the frame. Frames are shorter than 254
+    bytes, so every run fits in a single code byte.
+  */
+  unsigned int crc = calculate_crc16(frame, len);
+  frame[len++] = crc & 0xff;
+  frame[len++] = crc >> 8;
+  byte run_start = 0;
+  for (byte ctr = 0; ctr <= len; ctr++) {
+    if ((ctr == len) || (0 == frame[ctr])) {
+      Serial.write((byte)(ctr - run_start + 1));
+      Serial.write(frame + run_start, ctr - run_start);
+      run_start = ctr + 1;
+    }
+  }
+  Serial.write((byte)0);
+}
+
+unsigned int calculate_crc16(byte *data, byte len) {
+  /* Calculate the CRC-16/CCITT-FALSE of the given data
+  */
+  unsigned int crc = 0xffff;
+  for (byte ctr = 0; ctr < len; ctr++) {
+    crc ^= (unsigned int)data[ctr] << 8;
+    for (byte bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+void update_neutral(void) {
+  /* Read the ADC value for the neutral pin 
+  */
+  adc_neutral = analogRead(ADC_NEUTRAL_PIN);
+}
+
+ISR(TIMER1_COMPA_vect) {
+  /* The sample clock. Take the counts since the last tick and start counting
+    again - interrupts are already off in here, so the two-byte counters
+    can't tear. If the loop hasn't taken the last sample yet, this tick is
+    counted as missed and its pulses carry over to the next one.
+  */
+  if (1 == sample_due) {
+    if (samples_missed < 0xff)
+      samples_missed++;
+    return;
+  }
+  sample_time = millis();
+  sample_micros = micros();
+  sample_tacho = ctr_tacho;
+  sample_speedo = ctr_speedo;
+  ctr_tacho = 0;
+  ctr_speedo = 0;
+  sample_due = 1;
+}
+
+void start_sample_clock(unsigned int period_ms) {
+  /* Run Timer1 in CTC mode so its compare match interrupt fires every
+    period_ms, with the smallest prescaler that can count that long
+  */
+  const unsigned int prescalers[] = {1, 8, 64, 256, 1024};
+  byte ctr = 0;
+  while ((ctr < 4) && (period_ms > 65536000UL / (F_CPU / prescalers[ctr])))
+    ctr++;
+  unsigned long ticks = (F_CPU / prescalers[ctr]) * period_ms / 1000;
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | (ctr + 1);  // CTC on OCR1A, and the clock select bits for the prescaler
+  OCR1A = ticks - 1;
+  TCNT1 = 0;
+  TIMSK1 |= _BV(OCIE1A);
+  interrupts();
+}
+
+void set_sample_period(unsigned int period_ms) {
+  /* Change the sample period, applying it straight away. An open session
+    keeps the period in its header, later records just have bigger time deltas.
+  */
+  if ((period_ms < MIN_SAMPLE_PERIOD) || (period_ms > MAX_SAMPLE_PERIOD)) {
+    sprintf_P(debug_string, PSTR("sample period must be %u to %u ms"), MIN_SAMPLE_PERIOD, MAX_SAMPLE_PERIOD);
+    Serial.println(debug_string);
+    return;
+  }
+  sample_period = period_ms;
+  start_sample_clock(sample_period);
+  sprintf_P(debug_string, PSTR("sample_period(%u)"), sample_period);
+  Serial.println(debug_string);
+}
+
+void isr_tacho() {
+  /* Increment the tacho counter, and timestamp the edge if capturing
+  */
+  ctr_tacho++;
+  if (1 == edge_capture)
+    push_edge(&tacho_edges);
+}
+
+void isr_speedo() {
+  /* Increment the speedo counter, and timestamp the edge if capturing
+  */
+  ctr_speedo++;
+  if (1 == edge_capture)
+    push_edge(&speedo_edges);
+}
+
+void push_edge(EdgeRing *ring) {
+  /* Add an edge timestamp to a ring - only ever called from its ISR
+  */
+  byte next = (ring->head + 1) & (EDGE_RING_LEN - 1);
+  if (next == ring->tail) {
+    ring->overflows++;
+    return;
+  }
+  ring->edges[ring->head] = micros();
+  ring->head = next;
+}
+
+void drain_edges(EdgeRing *ring) {
+  /* Take the edges the ISR has added off the ring and into the sample window
+  */
+  while (ring->tail != ring->head) {
+    unsigned long edge = ring->edges[ring->tail];
+    ring->tail = (ring->tail + 1) & (EDGE_RING_LEN - 1);
+    if (ring->timing) {
+      unsigned long period = edge - ring->last_edge;
+      if ((0 == ring->window_edges) || (period < ring->period_min))
+        ring->period_min = period;
+      if ((0 == ring->window_edges) || (period > ring->period_max))
+        ring->period_max = period;
+      ring->period_last = period;
+      ring->last_edge = edge;
+      ring->window_edges++;
+    }
+    else {
+      ring->window_start = edge;
+      ring->last_edge = edge;
+      ring->timing = true;
+    }
+  }
+}
+
+unsigned long take_edge_period(EdgeRing *ring, unsigned int *spread) {
+  /* The mean period of the edges since the last sample, with how far the
+    shortest, longest and last single period were from it in spread, and
+    start the next sample from the last of them. All zero if there were none,
+    or if any were dropped - timing starts again from the next edge then.
+  */
+  drain_edges(ring);
+  spread[0] = 0;
+  spread[1] = 0;
+  spread[2] = 0;
+  byte overflows = ring->overflows;
+  if (overflows != ring->seen_overflows) {
+    ring->seen_overflows = overflows;
+    ring->timing = false;
+    ring->window_edges = 0;
+    #ifdef DEBUG_LOGGING
+    sprintf_P(debug_string, PSTR("edge_overflows(%u)"), overflows);
+    Serial.println(debug_string);
+    #endif
+    return 0;
+  }
+  if (0 == ring->window_edges)
+    return 0;
+  unsigned long period = (ring->last_edge - ring->window_start) / ring->window_edges;
+  unsigned long range[] = {period - ring->period_min, ring->period_max - period, ring->period_last - ring->period_min};
+  for (byte ctr = 0; ctr < 3; ctr++)
+    spread[ctr] = (range[ctr] > 0xffff) ? 0xffff : range[ctr];
+  ring->window_start = ring->last_edge;
+  ring->window_edges = 0;
+  return period;
+}
+
+void set_edge_capture(byte enabled) {
+  /* Turn edge timestamping on or off, starting the rings from empty
+  */
+  edge_capture = 0;
+  EdgeRing *rings[] = {&tacho_edges, &speedo_edges};
+  for (byte ctr = 0; ctr < 2; ctr++) {
+    rings[ctr]->tail = rings[ctr]->head;
+    rings[ctr]->seen_overflows = rings[ctr]->overflows;
+    rings[ctr]->timing = false;
+    rings[ctr]->window_edges = 0;
+  }
+  edge_capture = enabled;
+  sprintf_P(debug_string, PSTR("edge_capture(%u)"), enabled);
+  Serial.println(debug_string);
+}
+
+/* push button *********************************************************************/
+
+
+
+/* /push button *********************************************************************/
+
+/* flash *********************************************************************/
+
+void flash_init(void) {
+  /* Set up the flash filesystem
+  */
+  load_write_hint();
+  flash.set_write_hint(write_hint);
+  directory.init();  // reserves the directory sectors, so before flash.init()
+  flash.set_erase_ahead(ERASE_AHEAD_SECTORS);
+  flash.init();
+  if (directory.session_open()) {
+    // the power went off while logging, so close it where the data stops
+    recover_session();
+    directory.close_session();
+    Serial.println(F("closed interrupted session"));
+  }
+  sprintf_P(debug_string, PSTR("sessions(%u) write_address(%lu)"), directory.num_sessions(), flash.get_write_address());
+  Serial.println(debug_string);
+}
+
+void update_session(void) {
+  /* Open a session in the directory when logging starts and close it when
+    logging stops. With no room in the directory, logging doesn't start.
+  */
+  if ((1 == erasing) || (logging_enabled == logging_session))
+    return;
+  if ((1 == logging_enabled) && !directory.open_session(FILE_FORMAT_VERSION, PACKED_BLOCK_BYTES)) {
+    // data the directory doesn't list would never be decoded, so don't log it
+    logging_enabled = 0;
+    Serial.println(F("not logging, the session directory is full - erase_flash to start again"));
+    return;
+  }
+  logging_session = logging_enabled;
+  if (1 == logging_session) {
+    session_period = sample_period;
+    max_latency = 0;
+    write_file_header();
+    session_records = 0;
+    uncommitted_records = 0;
+    commit_address = flash.get_write_address();
+  }
+  else {
+    flush_records();
+    directory.close_session();
+    save_write_hint();
+    sprintf_P(debug_string, PSTR("session closed, queue_overflows(%u) max_latency(%u)"), queue_overflows, max_latency);
+    Serial.println(debug_string);
+  }
+}
+
+void capture_record(DataRecord *record) {
+  /* Fill in the rest of a sampled record and put it in the record queue, if
+    there is a session to log it to
+  */
+  record->adc_neutral = adc_neutral;
+  record->tacho_period = take_edge_period(&tacho_edges, record->tacho_spread);
+  record->speedo_period = take_edge_period(&speedo_edges, record->speedo_spread);
+  if (1 == logging_session) {
+    if (RECORD_QUEUE_LEN > queue_len[queue_filling]) {
+      record_queue[queue_filling][queue_len[queue_filling]++] = *record;
+    }
+    else {
+      queue_overflows++;
+      #ifdef DEBUG_LOGGING
+      sprintf_P(debug_string, PSTR("queue_overflows(%u)"), queue_overflows);
+      Serial.println(debug_string);
+      #endif
+    }
+  }
+  #ifdef DEBUG_LOGGING
+  print_record(record);
+  #endif
+}
+
+void drain_records(unsigned int budget_micros) {
+  /* Write queued records to flash until the queue is empty or the time
+    budget is used up. At least one record is written per call, unless the
+    erase ahead hasn't caught up with the writing - then the records stay
+    queued rather than the loop stalling for the erase.
+  */
+  unsigned long start = micros();
+  do {
+    // a record can finish off a packed block and then a commit marker
+    if (!flash.write_ready(PACKED_BLOCK_BYTES + COMMIT_MARKER_BYTES))
+      return;
+    byte writing = 1 - queue_filling;
+    if (queue_written == queue_len[writing]) {
+      if (0 == queue_len[queue_filling])
+        return;
+      // swap halves, sampling carries on into the empty one
+      queue_len[writing] = 0;
+      queue_written = 0;
+      queue_filling = writing;
+      writing = 1 - writing;
+    }
+    write_record(&record_queue[writing][queue_written++]);  // this calculates the CRC before writing
+    if ((uncommitted_records >= COMMIT_RECORDS) ||
+        (flash.ring_distance(commit_address, flash.get_write_address()) >= COMMIT_BYTES))
+      write_commit_marker(0);
+    if (flash.get_write_sector() != write_hint)
+      save_write_hint();
+  } while (micros() - start < budget_micros);
+}
+
+bool queue_empty(void) {
+  /* Is there nothing waiting to be written to flash?
+  */
+  return (queue_written == queue_len[1 - queue_filling]) && (0 == queue_len[queue_filling]);
+}
+
+void flush_records(void) {
+  /* Write everything queued, and the packed block it went into, to flash,
+    committing it if any records were written
+  */
+  while (!queue_empty()) {
+    flash.poll();
+    drain_records(DRAIN_BUDGET_MICROS);
+  }
+  write_packed_block();
+  if (0 != uncommitted_records)
+    write_commit_marker(0);
+}
+
+void clear_queue(void) {
+  /* Throw away everything queued, when the session it was for is gone
+  */
+  queue_len[0] = 0;
+  queue_len[1] = 0;
+  queue_written = 0;
+}
+
+void flash_erase(void) {
+  /* Start erasing the flash chip if the flag is set, and move a running erase
+    along without blocking the loop. Only the sectors that have been written
+    are erased, unless the whole chip was asked for.
+  */
+  flash.poll();
+  if (1 == erasing) {
+    logging_enabled = 0;  // nothing can be logged until the chip is clean
+    if (!flash.is_done())
+      return;
+    erasing = 0;
+    flash.set_write_address(flash.data_start);
+    directory.reset();
+    save_write_hint();
+    Serial.println(F("done erasing."));
+  }
+  if (!erase_flag) 
+    return;
+  logging_enabled = 0;
+  bool started = (ERASE_ALL == erase_flag) ? flash.begin_erase(0, flash.len_bytes) : flash.begin_erase_used();
+  if (!started)
+    return;  // still busy erasing ahead, try again next time
+  Serial.println((ERASE_ALL == erase_flag) ? F("erasing entire flash chip...") : F("erasing used flash..."));
+  erase_flag = 0;
+  erasing = 1;
+  logging_session = 0;  // any open session is erased along with everything else
+  packed_len = 0;
+  uncommitted_records = 0;
+  clear_queue();
+}
+
+void load_write_hint(void) {
+  /* Load the flash sector that was last written to from EEPROM
+  */
+  write_hint = (EEPROM.read(EEPROM_WRITE_HINT_ADDRESS + 1) << 8) | EEPROM.read(EEPROM_WRITE_HINT_ADDRESS);
+}
+
+void save_write_hint(void) {
+  /* Save the flash sector currently being written to EEPROM so the next boot
+    can find the write address without searching the whole chip
+  */
+  write_hint = flash.get_write_sector();
+  EEPROM.update(EEPROM_WRITE_HINT_ADDRESS, write_hint & 0xff);
+  EEPROM.update(EEPROM_WRITE_HINT_ADDRESS + 1, write_hint >> 8);
+}
+
+void flash_chip_query(void) {
+  /* query the flash chip for info and print it to serial
+  */
+  byte flash_info[] = {0,0,0,0,0,0};
+  flash.read_flash_info(flash_info);
+  sprintf_P(debug_string, PSTR("flash_info: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x"), 
+    flash_info[0], flash_info[1], flash_info[2], flash_info[3], flash_info[4], flash_info[5]);
+  Serial.println(debug_string);
+}
+
+/* \flash **********************************************************************/
+
+void write_file_header(void) {
+  /* Write the file header to flash
+  */
+  byte header_data[FILE_HEADER_TOTAL_LEN];
+  for(byte ctr = 0; ctr < FILE_HEADER_TOTAL_LEN; ctr++)
+    header_data[ctr] = 0xff;
+  FileHeader header;
+  memset(&header, 0xff, sizeof(header));
+  header.record_version = FILE_FORMAT_VERSION;
+  header.record_len = PACKED_BLOCK_BYTES;
+  header.sample_period = session_period;
+  memcpy(&header_data, FILE_HEADER_MAGIC_BYTES, FILE_HEADER_MAGIC_LEN);
+  memcpy(&header_data[FILE_HEADER_MAGIC_LEN], &header, FILE_HEADER_LEN);
+  header.check_byte = calculate_crc((byte*)&header_data, FILE_HEADER_TOTAL_LEN - 1);
+  header_data[FILE_HEADER_TOTAL_LEN - 1] = header.check_byte;
+  flash.write_data(header_data, sizeof(header_data));
+}
+
+bool read_file_header(unsigned long address, FileHeader *header) {
+  /* Read a file header from flash, checking the magic bytes and checksum
+  */
+  byte header_data[FILE_HEADER_TOTAL_LEN];
+  for(byte ctr = 0; ctr < FILE_HEADER_TOTAL_LEN; ctr++)
+    header_data[ctr] = 0xff;
+  flash.read_data(address, header_data, FILE_HEADER_TOTAL_LEN);
+  int res = memcmp(header_data, FILE_HEADER_MAGIC_BYTES, FILE_HEADER_MAGIC_LEN);
+  memcpy(header, header_data + FILE_HEADER_MAGIC_LEN, sizeof(FileHeader));  
+  byte calculated_checkbyte = calculate_crc((byte*)&header_data, FILE_HEADER_TOTAL_LEN - 1);
+  return (0 == res) && (header->check_byte == calculated_checkbyte);
+}
+
+void print_all_records(void) {
+  /* Print all the known records to the serial port
+  */
+//  for (unsigned long read_addr = 0; read_addr < flash.len_bytes - RECORD_BYTES; read_addr+=RECORD_BYTES) {
+//    DataRecord record;
+//    bool res = read_record(read_addr, &record);
+//    if ((0xff == record.record_version) || (0 == res))
+//      break;
+//    print_record(&record);
+//  }
+}
+
+byte calculate_crc(byte *data, byte len) {
+  /* Calculate the XOR checksum of the given data
+  */
+  byte checksum = 0;
+  for (byte ctr = 0; ctr < len; ctr++)
+    checksum ^= data[ctr];
+  return checksum;
+}
+
+void write_record(DataRecord *record) {
+  /* Pack a record into the current block, writing the block to flash when
+    it is full. The check_byte is updated, but only the block's is saved.
+  */
+  byte *record_data = (byte*)record;
+  record->check_byte = calculate_crc(record_data, sizeof(DataRecord) - 1);
+  if (0 == packed_len) {
+    start_packed_block(record);
+    return;
+  }
+  byte packed[2 + PACKED_FIELDS * 5];  // the mask, and the longest varint for each field
+  byte len = 2;  // the varints go after room for a two byte mask
+  unsigned int mask = 0;
+  long time_delta = (long)(record->ctr_record - packed_last.ctr_record) - session_period;
+  long tacho_delta = (long)record->ctr_tacho - (long)packed_last.ctr_tacho;
+  long speedo_delta = (long)record->ctr_speedo - (long)packed_last.ctr_speedo;
+  long neutral_delta = (long)record->adc_neutral - (long)packed_last.adc_neutral;
+  long tacho_period_delta = (long)(record->tacho_period - packed_last.tacho_period);
+  long speedo_period_delta = (long)(record->speedo_period - packed_last.speedo_period);
+  long missed_delta = (long)record->samples_missed - (long)packed_last.samples_missed;
+  long latency_delta = (long)record->sample_latency - (long)packed_last.sample_latency;
+  if (0 != time_delta) {
+    mask |= PACKED_TIME;
+    len += write_varint(packed + len, time_delta);
+  }
+  if (0 != tacho_delta) {
+    mask |= PACKED_TACHO;
+    len += write_varint(packed + len, tacho_delta);
+  }
+  if (0 != speedo_delta) {
+    mask |= PACKED_SPEEDO;
+    len += write_varint(packed + len, speedo_delta);
+  }
+  if (0 != neutral_delta) {
+    mask |= PACKED_NEUTRAL;
+    len += write_varint(packed + len, neutral_delta);
+  }
+  if (0 != tacho_period_delta) {
+    mask |= PACKED_TACHO_PERIOD;
+    len += write_varint(packed + len, tacho_period_delta);
+  }
+  if (0 != speedo_period_delta) {
+    mask |= PACKED_SPEEDO_PERIOD;
+    len += write_varint(packed + len, speedo_period_delta);
+  }
+  if (0 != missed_delta) {
+    mask |= PACKED_SAMPLES_MISSED;
+    len += write_varint(packed + len, missed_delta);
+  }
+  if (0 != latency_delta) {
+    mask |= PACKED_SAMPLE_LATENCY;
+    len += write_varint(packed + len, latency_delta);
+  }
+  len += pack_ranges(record, packed + len, &mask);
+  byte start = pack_mask(packed, mask);
+  len -= start;
+  // leave room for the check byte, and the record count is only a byte
+  if ((packed_len + len + 1 > PACKED_BLOCK_BYTES) || (255 == packed_block[1])) {
+    write_packed_block();
+    start_packed_block(record);
+    return;
+  }
+  memcpy(packed_block + packed_len, packed + start, len);
+  packed_len += len;
+  packed_block[1]++;
+  packed_last = *record;
+}
+
+void start_packed_block(DataRecord *record) {
+  /* Start a new packed block with the given record in full
+  */
+  packed_block[0] = PACKED_BLOCK_MARKER;
+  packed_block[1] = 1;
+  memcpy(packed_block + 2, record, PACKED_BLOCK_HEADER_BYTES - 2);
+  byte packed[2 + 6 * 5];  // the mask, and the longest varint for each range
+  unsigned int mask = 0;
+  byte len = 2 + pack_ranges(record, packed + 2, &mask);
+  byte start = pack_mask(packed, mask);
+  memcpy(packed_block + PACKED_BLOCK_HEADER_BYTES, packed + start, len - start);
+  packed_len = PACKED_BLOCK_HEADER_BYTES + len - start;
+  packed_last = *record;
+}
+
+byte pack_ranges(DataRecord *record, byte *data, unsigned int *mask) {
+  /* Write a varint for each of the record's period spreads that isn't zero,
+    and set its bit in the mask. Returns the bytes used.
+  */
+  unsigned int *spreads[] = {record->tacho_spread, record->speedo_spread};
+  unsigned int bits[] = {PACKED_TACHO_RANGE, PACKED_SPEEDO_RANGE};
+  byte len = 0;
+  for (byte input = 0; input < 2; input++) {
+    for (byte ctr = 0; ctr < 3; ctr++) {
+      if (0 == spreads[input][ctr])
+        continue;
+      *mask |= bits[input] << ctr;
+      len += write_varint(data + len, spreads[input][ctr]);
+    }
+  }
+  return len;
+}
+
+byte pack_mask(byte *packed, unsigned int mask) {
+  /* Put the mask in the two bytes before a packed record's varints, returning
+    where the record starts. It is one byte for the first seven fields, its
+    top bit set if a second byte follows for the rest.
+  */
+  packed[1] = mask;
+  if (0 == (mask >> 7))
+    return 1;
+  packed[0] = (mask & 0x7f) | 0x80;
+  packed[1] = mask >> 7;
+  return 0;
+}
+
+void write_packed_block(void) {
+  /* Finish off the current packed block with its check byte and write it
+  */
+  if (0 == packed_len)
+    return;
+  packed_block[packed_len] = calculate_crc(packed_block, packed_len);
+  #ifdef COMPRESS_BLOCKS
+  if (!write_compressed_block(packed_block, packed_len + 1))
+    flash.write_data(packed_block, packed_len + 1);
+  #else
+  flash.write_data(packed_block, packed_len + 1);
+  #endif
+  packed_len = 0;
+  session_records += packed_block[1];
+  uncommitted_records += packed_block[1];
+}
+
+bool write_compressed_block(byte *block, byte len) {
+  /* Write a packed block compressed, if that makes it smaller
+  */
+  byte compressed[PACKED_BLOCK_BYTES];
+  byte compressed_len = compress_block(block, len, compressed + 2, len - COMPRESSED_BLOCK_OVERHEAD - 1);
+  if (0 == compressed_len)
+    return false;
+  compressed[0] = COMPRESSED_BLOCK_MARKER;
+  compressed[1] = compressed_len;
+  compressed_len += 2;
+  compressed[compressed_len] = calculate_crc(compressed, compressed_len);
+  flash.write_data(compressed, compressed_len + 1);
+  return true;
+}
+
+byte compress_block(byte *data, byte len, byte *out, byte max_len) {
+  /* LZ compress data into out, looking for the longest earlier match at
+    each byte. Blocks are short, so the whole block is the window. Returns
+    the compressed length, or zero if it would be more than max_len.
+  */
+  byte out_len = 0;
+  byte run_start = 0;  // where the token for the literal run being built is
+  byte literals = 0;
+  byte pos = 0;
+  while (pos < len) {
+    byte best_len = 0;
+    byte best_back = 0;
+    for (byte from = 0; from < pos; from++) {
+      if (data[from] != data[pos])
+        continue;
+      byte match = 1;
+      while ((pos + match < len) && (match < 130) && (data[from + match] == data[pos + match]))
+        match++;
+      if (match >= best_len) {
+        best_len = match;
+        best_back = pos - from;
+      }
+    }
+    if (best_len >= 3) {
+      if (out_len + 2 > max_len)
+        return 0;
+      out[out_len++] = 0x80 | (best_len - 3);
+      out[out_len++] = best_back - 1;
+      literals = 0;
+      pos += best_len;
+      continue;
+    }
+    if (0 == literals) {
+      if (out_len + 1 >= max_len)
+        return 0;
+      run_start = out_len++;
+    }
+    else if (out_len >= max_len)
+      return 0;
+    out[run_start] = literals;
+    out[out_len++] = data[pos++];
+    if (128 == ++literals)
+      literals = 0;
+  }
+  return out_len;
+}
+
+byte decompress_block(byte *data, byte len, byte *out, byte max_len) {
+  /* Undo compress_block(). Returns the decompressed length, or zero if the
+    tokens don't make sense or would need more than max_len bytes.
+  */
+  byte in = 0;
+  byte out_len = 0;
+  while (in < len) {
+    byte token = data[in++];
+    if (token & 0x80) {
+      if (in >= len)
+        return 0;
+      byte back = data[in++] + 1;
+      byte count = (token & 0x7f) + 3;
+      if ((back > out_len) || (count > max_len - out_len))
+        return 0;
+      for (; count > 0; count--, out_len++)
+        out[out_len] = out[out_len - back];
+    }
+    else {
+      byte count = token + 1;
+      if ((count > len - in) || (count > max_len - out_len))
+        return 0;
+      memcpy(out + out_len, data + in, count);
+      in += count;
+      out_len += count;
+    }
+  }
+  return out_len;
+}
+
+void write_commit_marker(unsigned int torn_bytes) {
+  /* Write a commit marker and program it, and anything staged before it,
+    now rather than when the page fills up
+  */
+  byte marker[COMMIT_MARKER_BYTES];
+  make_commit_marker(marker, session_records, torn_bytes);
+  flash.write_data(marker, COMMIT_MARKER_BYTES);
+  flash.flush();
+  uncommitted_records = 0;
+  commit_address = flash.get_write_address();
+}
+
+byte check_packed_block(byte *data, byte len, unsigned long *records) {
+  /* How long the commit marker or packed block at the start of data is, or
+    zero if there isn't a whole valid one there. A marker sets the record
+    count, a block adds its records to it. A compressed block is unpacked
+    into packed_block to be checked.
+  */
+  if ((COMPRESSED_BLOCK_OVERHEAD < len) && (COMPRESSED_BLOCK_MARKER == data[0])) {
+    if ((data[1] + 2 >= len) || (data[data[1] + 2] != calculate_crc(data, data[1] + 2)))
+      return 0;
+    byte block_len = decompress_block(data + 2, data[1], packed_block, PACKED_BLOCK_BYTES);
+    if ((0 == block_len) || (block_len != check_packed_block(packed_block, block_len, records)))
+      return 0;
+    return data[1] + COMPRESSED_BLOCK_OVERHEAD;
+  }
+  if ((0 < len) && (COMMIT_MARKER == data[0]))
+    return check_commit_marker(data, len, records);
+  if ((PACKED_BLOCK_HEADER_BYTES >= len) || (PACKED_BLOCK_MARKER != data[0]) || (0 == data[1]))
+    return 0;
+  byte used = PACKED_BLOCK_HEADER_BYTES;
+  for (byte record = 0; record < data[1]; record++) {
+    if (used >= len)
+      return 0;
+    unsigned int mask = data[used++];
+    if (mask & 0x80) {
+      if (used >= len)
+        return 0;
+      mask = (mask & 0x7f) | ((unsigned int)data[used++] << 7);
+    }
+    // the first record only packs its ranges, the rest of it is in the header
+    if ((mask >> PACKED_FIELDS) || ((0 == record) && (mask & (PACKED_TACHO_RANGE - 1))))
+      return 0;
+    for (byte bit = 0; bit < PACKED_FIELDS; bit++) {
+      if (0 == (mask & (1 << bit)))
+        continue;
+      byte varint_len = 0;
+      do {
+        if ((used >= len) || (++varint_len > 5))
+          return 0;
+      } while (data[used++] & 0x80);
+    }
+  }
+  if ((used >= len) || (data[used] != calculate_crc(data, used)))
+    return 0;
+  *records += data[1];
+  return used + 1;
+}
+
+void recover_session(void) {
+  /* The power went off while logging. Everything up to the last commit
+    marker is whole, so only the blocks after it are checked, a few reads
+    however full the chip is. If that marker is lost, the whole session is
+    checked from its first block. A marker is written after the last whole
+    block, recording the torn bytes after it, so the session ends committed.
+  */
+  SessionEntry entry;
+  directory.read_entry(directory.num_sessions() - 1, &entry);
+  unsigned long end = flash.get_write_address();
+  if (flash.ring_distance(entry.start_address, end) < FILE_HEADER_TOTAL_LEN)
+    return;  // the header never made it, there's nothing to recover
+  unsigned long first_block = flash.ring_address(entry.start_address, FILE_HEADER_TOTAL_LEN);
+  unsigned long committed = find_commit_marker(&flash, first_block, end, COMMIT_SEARCH_BYTES, &session_records);
+  unsigned long address = committed;
+  byte data[PACKED_BLOCK_BYTES];
+  while (address != end) {
+    unsigned long left = flash.ring_distance(address, end);
+    byte len = (left < PACKED_BLOCK_BYTES) ? left : PACKED_BLOCK_BYTES;
+    flash.read_ring(address, data, len);
+    byte used = check_packed_block(data, len, &session_records);
+    if (0 == used)
+      break;
+    address = flash.ring_address(address, used);
+  }
+  unsigned long torn_bytes = flash.ring_distance(address, end);
+  if ((0 != torn_bytes) || (address != committed))
+    write_commit_marker((torn_bytes > 0xffff) ? 0xffff : torn_bytes);
+  sprintf_P(debug_string, PSTR("recovered session: records(%lu) torn_bytes(%lu)"), session_records, torn_bytes);
+  Serial.println(debug_string);
+}
+
+byte write_varint(byte *data, long value) {
+  /* Zig-zag encode a signed value so small magnitudes stay small, then write
+    it seven bits at a time, low bits first. Returns the bytes used.
+  */
+  unsigned long zigzag = ((unsigned long)value << 1) ^ (unsigned long)(value >> 31);
+  byte len = 0;
+  while (zigzag >= 0x80) {
+    data[len++] = (zigzag & 0x7f) | 0x80;
+    zigzag >>= 7;
+  }
+  data[len++] = zigzag;
+  return len;
+}
+
+bool read_record(unsigned long address, DataRecord *record) {
+  /* Read a record from the specified flash location
+  */
+  byte *record_data = (byte*)record;
+  flash.read_data(address, record_data, sizeof(DataRecord));
+  byte check_byte = calculate_crc(record_data, sizeof(DataRecord) - 1);
+  return (check_byte == record->check_byte);
+}
+
+void print_record(DataRecord *record) {
+  /* Print a data record to the serial port
+  */
+  sprintf_P(debug_string, PSTR("ctr(%lu) t(%u) s(%u) n(%u) tp(%lu) sp(%lu) m(%u) l(%u) x(0x%02x)"),
+    record->ctr_record, record->ctr_tacho, record->ctr_speedo, record->adc_neutral,
+    record->tacho_period, record->speedo_period, record->samples_missed, record->sample_latency,
+    record->check_byte);
+  Serial.println(debug_string);
+  sprintf_P(debug_string, PSTR("  ts(%u, %u, %u) ss(%u, %u, %u)"), record->tacho_spread[0], record->tacho_spread[1],
+    record->tacho_spread[2], record->speedo_spread[0], record->speedo_spread[1], record->speedo_spread[2]);
+  Serial.println(debug_string);
+}
+
+// end
@@ -0,0 +1,670 @@
+/*
+Decode flash images dumped from gears_logger on a host machine.
+*/
+
+#include "log_decoder.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <thread>
+
+const size_t DECODE_CHUNK_BYTES = 1 << 18;  // sessions longer than this are decoded in parallel chunks
+const size_t NO_BLOCK = (size_t)-1;
+
+struct DecodeChunk {
+  size_t session;
+  size_t begin;  // offsets into the session's records, the header excluded
+  size_t end;
+  bool sync;  // does this chunk have to find its first block, or does it start on one?
+  size_t first_block;  // where decoding actually started, NO_BLOCK if nothing decoded
+  size_t last_end;  // where decoding stopped
+  bool searching;  // did it stop while looking for a marker after a bad block?
+  Columns columns;
+  DecodeStats stats;
+};
+
+static inline uint16_t read_u16(const uint8_t *data) {
+  return data[0] | (data[1] << 8);
+}
+
+static inline uint32_t read_u32(const uint8_t *data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void run_parallel(size_t num_tasks, unsigned int threads, const std::function<void(size_t)> &task) {
+  /* Run task(0) to task(num_tasks - 1) on a handful of threads
+  */
+  if (threads < 1)
+    threads = 1;
+  if (threads > num_tasks)
+    threads = num_tasks;
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned int ctr = 0; ctr < threads; ctr++) {
+    workers.push_back(std::thread([&]() {
+      for (size_t index = next++; index < num_tasks; index = next++)
+        task(index);
+    }));
+  }
+  for (size_t ctr = 0; ctr < workers.size(); ctr++)
+    workers[ctr].join();
+}
+
+uint8_t calculate_crc(const uint8_t *data, size_t len) {
+  /* Calculate the XOR checksum of the given data, as the logger does
+  */
+  uint8_t checksum = 0;
+  for (size_t ctr = 0; ctr < len; ctr++)
+    checksum ^= data[ctr];
+  return checksum;
+}
+
+uint16_t calculate_crc16(const uint8_t *data, size_t len) {
+  /* Calculate the CRC-16/CCITT-FALSE of the given data, as the logger's dump does
+  */
+  uint16_t crc = 0xffff;
+  for (size_t ctr = 0; ctr < len; ctr++) {
+    crc ^= (uint16_t)data[ctr] << 8;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+void Columns::append(const Columns &other) {
+  time.insert(time.end(), other.time.begin(), other.time.end());
+  tacho.insert(tacho.end(), other.tacho.begin(), other.tacho.end());
+  speedo.insert(speedo.end(), other.speedo.begin(), other.speedo.end());
+  neutral.insert(neutral.end(), other.neutral.begin(), other.neutral.end());
+  tacho_period.insert(tacho_period.end(), other.tacho_period.begin(), other.tacho_period.end());
+  speedo_period.insert(speedo_period.end(), other.speedo_period.begin(), other.speedo_period.end());
+  samples_missed.insert(samples_missed.end(), other.samples_missed.begin(), other.samples_missed.end());
+  sample_latency.insert(sample_latency.end(), other.sample_latency.begin(), other.sample_latency.end());
+  tacho_period_min.insert(tacho_period_min.end(), other.tacho_period_min.begin(), other.tacho_period_min.end());
+  tacho_period_max.insert(tacho_period_max.end(), other.tacho_period_max.begin(), other.tacho_period_max.end());
+  tacho_period_last.insert(tacho_period_last.end(), other.tacho_period_last.begin(), other.tacho_period_last.end());
+  speedo_period_min.insert(speedo_period_min.end(), other.speedo_period_min.begin(), other.speedo_period_min.end());
+  speedo_period_max.insert(speedo_period_max.end(), other.speedo_period_max.begin(), other.speedo_period_max.end());
+  speedo_period_last.insert(speedo_period_last.end(), other.speedo_period_last.begin(), other.speedo_period_last.end());
+  session.insert(session.end(), other.session.begin(), other.session.end());
+}
+
+static inline bool read_varint(const uint8_t **data, const uint8_t *end, int32_t *value) {
+  /* Read a zig-zag varint written by the logger's write_varint()
+  */
+  uint32_t zigzag = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*data >= end)
+      return false;
+    uint8_t next = *(*data)++;
+    zigzag |= (uint32_t)(next & 0x7f) << shift;
+    if (0 == (next & 0x80)) {
+      *value = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+struct RecordField {
+  size_t offset;  // in the DataRecord
+  int bytes;
+};
+
+// time, tacho, speedo, neutral, tacho period, speedo period, samples missed, sample latency, then the
+// shortest, longest and last tacho period and speedo period
+const RecordField RECORD_FIELDS[] = {{0, 4}, {4, 2}, {6, 2}, {8, 2}, {10, 4}, {14, 4}, {18, 1}, {19, 2},
+  {21, 4}, {25, 4}, {29, 4}, {33, 4}, {37, 4}, {41, 4}};
+const int MAX_RECORD_FIELDS = 14;
+
+static inline uint32_t read_field(const uint8_t *data, int bytes) {
+  if (4 == bytes)
+    return read_u32(data);
+  return (2 == bytes) ? read_u16(data) : data[0];
+}
+
+static size_t decode_block(const uint8_t *data, const uint8_t *end, uint8_t version, uint16_t sample_period,
+    uint16_t session, Columns *columns) {
+  /* Decode one packed block into the columns. Returns the bytes it used, or
+    zero, with nothing added, if there isn't a whole valid block here. Each
+    version added fields to the end of the record. From version 7 the mask's
+    top bit says a second mask byte follows. From version 8 the period ranges
+    are packed against each record's mean period, the first record's too.
+  */
+  int fields = (2 == version) ? 4 : (3 == version) ? 6 : (version < 7) ? 8 : 14;
+  int header_fields = (version < 8) ? fields : 8;
+  size_t header_bytes = 2 + RECORD_FIELDS[header_fields - 1].offset + RECORD_FIELDS[header_fields - 1].bytes;
+  if ((end - data < (ptrdiff_t)header_bytes + 1) || (PACKED_BLOCK_MARKER != data[0]) || (0 == data[1]))
+    return 0;
+  uint8_t count = data[1];
+  uint32_t value[MAX_RECORD_FIELDS][255];
+  for (int field = 0; field < MAX_RECORD_FIELDS; field++) {
+    value[field][0] = (field < header_fields) ?
+      read_field(data + 2 + RECORD_FIELDS[field].offset, RECORD_FIELDS[field].bytes) : 0;
+  }
+  const uint8_t *next = data + header_bytes;
+  for (int ctr = (version < 8) ? 1 : 0; ctr < count; ctr++) {
+    if (next >= end)
+      return 0;
+    uint32_t mask = *next++;
+    if ((version >= 7) && (mask & 0x80)) {
+      if (next >= end)
+        return 0;
+      mask = (mask & 0x7f) | ((uint32_t)*next++ << 7);
+    }
+    if ((mask >> fields) || ((0 == ctr) && (mask & (PACKED_TACHO_RANGE - 1))))
+      return 0;
+    for (int field = 0; field < MAX_RECORD_FIELDS; field++) {
+      int32_t delta = 0;
+      if ((mask & (1 << field)) && !read_varint(&next, end, &delta))
+        return 0;
+      if (field >= header_fields)
+        value[field][ctr] = delta;  // a spread from the mean period, not a delta
+      else if (0 != ctr)
+        value[field][ctr] = value[field][ctr - 1] + delta;
+      if (RECORD_FIELDS[field].bytes < 4)
+        value[field][ctr] &= (1UL << (8 * RECORD_FIELDS[field].bytes)) - 1;
+    }
+    if (0 != ctr)
+      value[0][ctr] += sample_period;
+  }
+  if ((next >= end) || (*next != calculate_crc(data, next - data)))
+    return 0;
+  for (int ctr = 0; (version >= 8) && (ctr < count); ctr++) {
+    // the mean less the shortest, the longest less the mean and the last less the shortest, each at most 0xffff
+    for (int input = 0; input < 2; input++) {
+      uint32_t *range[] = {&value[8 + 3 * input][ctr], &value[9 + 3 * input][ctr], &value[10 + 3 * input][ctr]};
+      *range[0] = value[4 + input][ctr] - *range[0];
+      *range[1] += value[4 + input][ctr];
+      *range[2] += *range[0];
+    }
+  }
+  columns->time.insert(columns->time.end(), value[0], value[0] + count);
+  columns->tacho.insert(columns->tacho.end(), value[1], value[1] + count);
+  columns->speedo.insert(columns->speedo.end(), value[2], value[2] + count);
+  columns->neutral.insert(columns->neutral.end(), value[3], value[3] + count);
+  columns->tacho_period.insert(columns->tacho_period.end(), value[4], value[4] + count);
+  columns->speedo_period.insert(columns->speedo_period.end(), value[5], value[5] + count);
+  columns->samples_missed.insert(columns->samples_missed.end(), value[6], value[6] + count);
+  columns->sample_latency.insert(columns->sample_latency.end(), value[7], value[7] + count);
+  columns->tacho_period_min.insert(columns->tacho_period_min.end(), value[8], value[8] + count);
+  columns->tacho_period_max.insert(columns->tacho_period_max.end(), value[9], value[9] + count);
+  columns->tacho_period_last.insert(columns->tacho_period_last.end(), value[10], value[10] + count);
+  columns->speedo_period_min.insert(columns->speedo_period_min.end(), value[11], value[11] + count);
+  columns->speedo_period_max.insert(columns->speedo_period_max.end(), value[12], value[12] + count);
+  columns->speedo_period_last.insert(columns->speedo_period_last.end(), value[13], value[13] + count);
+  columns->session.insert(columns->session.end(), count, session);
+  return next + 1 - data;
+}
+
+static size_t decompress_block(const uint8_t *data, size_t len, uint8_t *out, size_t max_len) {
+  /* Undo the logger's compress_block(). Returns the decompressed length, or
+    zero if the tokens don't make sense or would need more than max_len bytes.
+  */
+  const uint8_t *end = data + len;
+  size_t out_len = 0;
+  while (data < end) {
+    uint8_t token = *data++;
+    if (token & 0x80) {
+      if (data >= end)
+        return 0;
+      size_t back = *data++ + 1;
+      size_t count = (token & 0x7f) + 3;
+      if ((back > out_len) || (count > max_len - out_len))
+        return 0;
+      for (; count > 0; count--, out_len++)
+        out[out_len] = out[out_len - back];
+    }
+    else {
+      size_t count = token + 1;
+      if ((count > (size_t)(end - data)) || (count > max_len - out_len))
+        return 0;
+      memcpy(out + out_len, data, count);
+      data += count;
+      out_len += count;
+    }
+  }
+  return out_len;
+}
+
+static size_t decode_compressed(const uint8_t *data, const uint8_t *end, const Session &session, DecodeChunk *chunk) {
+  /* Decode one compressed block into the chunk's columns. Returns the bytes
+    it used, or zero if there isn't a whole valid one here.
+  */
+  if ((session.record_version < 6) || (end - data < 4) || (COMPRESSED_BLOCK_MARKER != data[0]))
+    return 0;
+  size_t used = data[1] + 2;
+  if ((end - data <= (ptrdiff_t)used) || (data[used] != calculate_crc(data, used)))
+    return 0;
+  uint8_t block[256];
+  size_t block_len = decompress_block(data + 2, data[1], block, sizeof(block));
+  if ((0 == block_len) || (0 == decode_block(block, block + block_len, session.record_version,
+      session.sample_period, chunk->session, &chunk->columns)))
+    return 0;
+  chunk->stats.records += block[1];
+  return used + 1;
+}
+
+static size_t decode_commit(const uint8_t *data, const uint8_t *end, uint8_t version) {
+  /* The length of the commit marker at data, or zero if there isn't a whole
+    valid one. Markers carry nothing the records don't, so they are skipped.
+  */
+  if ((version < 5) || (end - data < (ptrdiff_t)COMMIT_MARKER_BYTES) || (COMMIT_MARKER != data[0]) ||
+      (COMMIT_MAGIC != data[1]) || (data[COMMIT_MARKER_BYTES - 1] != calculate_crc(data, COMMIT_MARKER_BYTES - 1)))
+    return 0;
+  return COMMIT_MARKER_BYTES;
+}
+
+static const uint8_t *find_marker(const uint8_t *data, const uint8_t *end, uint8_t version) {
+  /* The next byte that could start a block of either kind, or a commit
+    marker, or NULL
+  */
+  for (; data < end; data++) {
+    if ((PACKED_BLOCK_MARKER == *data) || ((version >= 5) && (COMMIT_MARKER == *data)) ||
+        ((version >= 6) && (COMPRESSED_BLOCK_MARKER == *data)))
+      return data;
+  }
+  return NULL;
+}
+
+static void decode_packed(const uint8_t *data, size_t data_len, const Session &session, DecodeChunk *chunk) {
+  /* Decode the packed blocks that start in [begin, end). A chunk that has to
+    sync skips ahead to the first byte a whole valid block or commit marker
+    decodes from. A bad block is counted and skipped by looking for the next
+    marker. Erased flash ends the session.
+  */
+  const uint8_t *end = data + data_len;
+  size_t offset = chunk->begin;
+  chunk->first_block = NO_BLOCK;
+  chunk->searching = false;
+  while (offset < chunk->end) {
+    size_t len = decode_commit(data + offset, end, session.record_version);
+    if (0 == len)
+      len = decode_compressed(data + offset, end, session, chunk);
+    if (0 == len) {
+      len = decode_block(data + offset, end, session.record_version, session.sample_period,
+        chunk->session, &chunk->columns);
+      if (0 != len)
+        chunk->stats.records += data[offset + 1];
+    }
+    if (0 != len) {
+      if (NO_BLOCK == chunk->first_block)
+        chunk->first_block = offset;
+      chunk->searching = false;
+      offset += len;
+      continue;
+    }
+    if (0xff == data[offset])
+      break;
+    if (!chunk->sync || (NO_BLOCK != chunk->first_block))
+      chunk->stats.bad_blocks++;
+    const uint8_t *marker = find_marker(data + offset + 1, data + chunk->end, session.record_version);
+    offset = (NULL == marker) ? chunk->end : marker - data;
+    chunk->searching = NULL == marker;
+  }
+  chunk->last_end = offset;
+}
+
+static void decode_records(const uint8_t *data, size_t data_len, DecodeChunk *chunk) {
+  /* Decode the raw DataRecords in [begin, end), until the flash is erased
+  */
+  size_t offset = chunk->begin;
+  chunk->first_block = offset;
+  for (; (offset < chunk->end) && (offset + DATA_RECORD_LEN <= data_len); offset += DATA_RECORD_LEN) {
+    const uint8_t *record = data + offset;
+    if (0xffffffff == read_u32(record) && (0xff == record[DATA_RECORD_LEN - 1]))
+      break;
+    if (record[DATA_RECORD_LEN - 1] != calculate_crc(record, DATA_RECORD_LEN - 1)) {
+      chunk->stats.bad_records++;
+      continue;
+    }
+    chunk->columns.time.push_back(read_u32(record));
+    chunk->columns.tacho.push_back(read_u16(record + 4));
+    chunk->columns.speedo.push_back(read_u16(record + 6));
+    chunk->columns.neutral.push_back(read_u16(record + 8));
+    chunk->columns.tacho_period.push_back(0);
+    chunk->columns.speedo_period.push_back(0);
+    chunk->columns.samples_missed.push_back(0);
+    chunk->columns.sample_latency.push_back(0);
+    chunk->columns.tacho_period_min.push_back(0);
+    chunk->columns.tacho_period_max.push_back(0);
+    chunk->columns.tacho_period_last.push_back(0);
+    chunk->columns.speedo_period_min.push_back(0);
+    chunk->columns.speedo_period_max.push_back(0);
+    chunk->columns.speedo_period_last.push_back(0);
+    chunk->columns.session.push_back(chunk->session);
+    chunk->stats.records++;
+  }
+  chunk->last_end = offset;
+}
+
+LogImage::LogImage() {
+  fd = -1;
+  image = NULL;
+  image_len = 0;
+  ring_start = 0;
+}
+
+LogImage::~LogImage() {
+  if (NULL != image)
+    munmap((void*)image, image_len);
+  if (fd >= 0)
+    close(fd);
+}
+
+bool LogImage::open(const char *path) {
+  /* Map the image read-only, the page cache does the rest
+  */
+  fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat file_stat;
+  if ((0 != fstat(fd, &file_stat)) || (0 == file_stat.st_size))
+    return false;
+  void *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (MAP_FAILED == mapped)
+    return false;
+  image = (const uint8_t*)mapped;
+  image_len = file_stat.st_size;
+  madvise(mapped, image_len, MADV_SEQUENTIAL);
+  return true;
+}
+
+std::vector<Session> LogImage::find_sessions(unsigned int threads) {
+  /* Scan the image for file headers, in parallel slices that overlap by a
+    header so none are missed, then take lengths from the session directory
+    where it has them. Sessions without a directory entry run until the next
+    header.
+  */
+  size_t slices = std::max(1u, threads) * 4;
+  size_t slice_len = image_len / slices + 1;
+  std::vector<std::vector<size_t> > found(slices);
+  run_parallel(slices, threads, [&](size_t slice) {
+    size_t begin = slice * slice_len;
+    size_t end = std::min(image_len, begin + slice_len + FILE_HEADER_TOTAL_LEN - 1);
+    for (size_t offset = begin; offset + FILE_HEADER_TOTAL_LEN <= end; offset++) {
+      const uint8_t *next = (const uint8_t*)memchr(image + offset, FILE_HEADER_MAGIC_BYTES[0], end - offset);
+      if (NULL == next)
+        break;
+      offset = next - image;
+      if ((offset >= begin + slice_len) || (offset + FILE_HEADER_TOTAL_LEN > end))
+        break;
+      if ((0 == memcmp(next, FILE_HEADER_MAGIC_BYTES, FILE_HEADER_MAGIC_LEN)) &&
+          (next[FILE_HEADER_TOTAL_LEN - 1] == calculate_crc(next, FILE_HEADER_TOTAL_LEN - 1)))
+        found[slice].push_back(offset);
+    }
+  });
+  std::vector<Session> sessions;
+  for (size_t slice = 0; slice < slices; slice++) {
+    for (size_t ctr = 0; ctr < found[slice].size(); ctr++) {
+      const uint8_t *header = image + found[slice][ctr];
+      Session session;
+      session.header_address = found[slice][ctr];
+      session.length = 0;
+      session.from_directory = false;
+      session.record_version = header[FILE_HEADER_MAGIC_LEN];
+      session.record_len = header[FILE_HEADER_MAGIC_LEN + 1];
+      session.sample_period = read_u16(header + FILE_HEADER_MAGIC_LEN + 2);
+      sessions.push_back(session);
+    }
+  }
+  for (size_t ctr = 0; ctr < sessions.size(); ctr++) {
+    size_t next = (ctr + 1 < sessions.size()) ? sessions[ctr + 1].header_address : image_len;
+    sessions[ctr].length = next - sessions[ctr].header_address;
+  }
+  read_directory(&sessions);
+  return sessions;
+}
+
+void LogImage::read_directory(std::vector<Session> *sessions) {
+  /* Find the live directory sector, the one with the highest generation, and
+    use the lengths of its closed sessions
+  */
+  int live = -1;
+  uint32_t generation = 0;
+  for (size_t sector = 0; sector < DIRECTORY_SECTORS; sector++) {
+    const uint8_t *header = image + sector * FLASH_SECTOR_BYTES;
+    if ((sector + 1) * FLASH_SECTOR_BYTES > image_len)
+      break;
+    if ((0 != memcmp(header, DIRECTORY_MAGIC_BYTES, sizeof(DIRECTORY_MAGIC_BYTES))) ||
+        (header[DIRECTORY_ENTRY_BYTES - 1] != calculate_crc(header, DIRECTORY_ENTRY_BYTES - 1)))
+      continue;
+    if ((live < 0) || (read_u32(header + 8) > generation)) {
+      live = sector;
+      generation = read_u32(header + 8);
+    }
+  }
+  if (live < 0)
+    return;
+  ring_start = DIRECTORY_SECTORS * FLASH_SECTOR_BYTES;
+  std::map<size_t, size_t> lengths;
+  for (size_t slot = 1; slot < FLASH_SECTOR_BYTES / DIRECTORY_ENTRY_BYTES; slot++) {
+    const uint8_t *entry = image + live * FLASH_SECTOR_BYTES + slot * DIRECTORY_ENTRY_BYTES;
+    if ((0xffffffff == read_u32(entry)) || (entry[7] != calculate_crc(entry, 7)))
+      continue;
+    if ((0xffffffff != read_u32(entry + 8)) && (entry[14] == calculate_crc(entry + 8, 6)))
+      lengths[read_u32(entry)] = read_u32(entry + 8);
+  }
+  for (size_t ctr = 0; ctr < sessions->size(); ctr++) {
+    Session &session = (*sessions)[ctr];
+    std::map<size_t, size_t>::const_iterator found = lengths.find(session.header_address);
+    if ((lengths.end() != found) && (found->second >= FILE_HEADER_TOTAL_LEN) &&
+        (found->second <= image_len - ring_start)) {
+      session.length = found->second;
+      session.from_directory = true;
+    }
+  }
+}
+
+Columns LogImage::decode(const std::vector<Session> &sessions, unsigned int threads, DecodeStats *stats) const {
+  /* Decode every session, splitting long ones into chunks so they decode in
+    parallel too. Packed chunks after the first find their own starting block,
+    then a chunk that didn't start where the one before it stopped is decoded
+    again from there - rare, and it keeps a false sync from costing records.
+  */
+  std::vector<std::vector<uint8_t> > unwrapped(sessions.size());
+  std::vector<const uint8_t*> data(sessions.size());
+  std::vector<size_t> data_len(sessions.size());
+  std::vector<DecodeChunk> chunks;
+  for (size_t ctr = 0; ctr < sessions.size(); ctr++) {
+    const Session &session = sessions[ctr];
+    size_t start = session.header_address + FILE_HEADER_TOTAL_LEN;
+    size_t len = session.length - FILE_HEADER_TOTAL_LEN;
+    if (start + len <= image_len) {
+      data[ctr] = image + start;
+    }
+    else {
+      // the session wrapped around the end of the ring log
+      size_t first = (start < image_len) ? image_len - start : 0;
+      size_t wrapped = ring_start + ((start < image_len) ? 0 : start - image_len);
+      unwrapped[ctr].assign(image + std::min(start, image_len), image + image_len);
+      unwrapped[ctr].insert(unwrapped[ctr].end(), image + wrapped, image + std::min(image_len, wrapped + len - first));
+      data[ctr] = unwrapped[ctr].data();
+      len = unwrapped[ctr].size();
+    }
+    data_len[ctr] = len;
+    size_t step = DECODE_CHUNK_BYTES;
+    if (1 == session.record_version)
+      step -= step % DATA_RECORD_LEN;
+    else if ((session.record_version < 2) || (session.record_version > 7))
+      continue;
+    for (size_t begin = 0; (begin < len) || (0 == begin); begin += step) {
+      DecodeChunk chunk = DecodeChunk();
+      chunk.session = ctr;
+      chunk.begin = begin;
+      chunk.end = std::min(len, begin + step);
+      chunk.sync = 0 != begin;
+      chunks.push_back(chunk);
+    }
+  }
+  run_parallel(chunks.size(), threads, [&](size_t index) {
+    DecodeChunk &chunk = chunks[index];
+    if (1 == sessions[chunk.session].record_version)
+      decode_records(data[chunk.session], data_len[chunk.session], &chunk);
+    else
+      decode_packed(data[chunk.session], data_len[chunk.session], sessions[chunk.session], &chunk);
+  });
+  Columns columns;
+  DecodeStats total = DecodeStats();
+  size_t last_end = 0;
+  bool finished = false;  // did the chunk before this one run into erased flash?
+  bool searching = false;  // or stop looking for a marker, which this chunk carried on with?
+  for (size_t ctr = 0; ctr < chunks.size(); ctr++) {
+    DecodeChunk &chunk = chunks[ctr];
+    if (!chunk.sync) {
+      finished = false;
+    }
+    else if (finished) {
+      continue;
+    }
+    else if ((chunk.first_block != last_end) && !(searching && (chunk.begin == last_end))) {
+      size_t end = chunk.end;
+      size_t session = chunk.session;
+      chunk = DecodeChunk();
+      chunk.session = session;
+      chunk.begin = last_end;
+      chunk.end = end;
+      chunk.sync = false;
+      decode_packed(data[session], data_len[session], sessions[session], &chunk);
+    }
+    last_end = chunk.last_end;
+    finished = chunk.last_end < chunk.end;
+    searching = chunk.searching;
+    columns.append(chunk.columns);
+    total.records += chunk.stats.records;
+    total.bad_records += chunk.stats.bad_records;
+    total.bad_blocks += chunk.stats.bad_blocks;
+  }
+  if (NULL != stats)
+    *stats = total;
+  return columns;
+}
+
+bool write_csv(const char *path, const Columns &columns) {
+  /* Write the columns as CSV, one row per record
+  */
+  FILE *out = fopen(path, "w");
+  if (NULL == out)
+    return false;
+  static char buffer[1 << 20];
+  setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+  fprintf(out, "session,time,tacho,speedo,neutral,tacho_period,speedo_period,samples_missed,sample_latency,"
+    "tacho_period_min,tacho_period_max,tacho_period_last,speedo_period_min,speedo_period_max,speedo_period_last\n");
+  for (size_t ctr = 0; ctr < columns.size(); ctr++) {
+    fprintf(out, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n", columns.session[ctr], columns.time[ctr],
+      columns.tacho[ctr], columns.speedo[ctr], columns.neutral[ctr],
+      columns.tacho_period[ctr], columns.speedo_period[ctr],
+      columns.samples_missed[ctr], columns.sample_latency[ctr],
+      columns.tacho_period_min[ctr], columns.tacho_period_max[ctr], columns.tacho_period_last[ctr],
+      columns.speedo_period_min[ctr], columns.speedo_period_max[ctr], columns.speedo_period_last[ctr]);
+  }
+  return 0 == fclose(out);
+}
+
+bool write_columnar(const char *path, const Columns &columns) {
+  /* Write the columns as little-endian arrays, one after the other: the magic
+    "GEARCOL4", a uint64 row count, then time as uint32, tacho, speedo and
+    neutral as uint16, the tacho and speedo periods as uint32, samples missed
+    as uint8, sample latency and session as uint16, then the shortest,
+    longest and last tacho periods and speedo periods as uint32.
+    numpy.fromfile() reads them straight in.
+  */
+  FILE *out = fopen(path, "wb");
+  if (NULL == out)
+    return false;
+  uint64_t rows = columns.size();
+  bool ok = 1 == fwrite("GEARCOL4", 8, 1, out);
+  ok &= 1 == fwrite(&rows, sizeof(rows), 1, out);
+  ok &= rows == fwrite(columns.time.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.tacho.data(), sizeof(uint16_t), rows, out);
+  ok &= rows == fwrite(columns.speedo.data(), sizeof(uint16_t), rows, out);
+  ok &= rows == fwrite(columns.neutral.data(), sizeof(uint16_t), rows, out);
+  ok &= rows == fwrite(columns.tacho_period.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.speedo_period.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.samples_missed.data(), sizeof(uint8_t), rows, out);
+  ok &= rows == fwrite(columns.sample_latency.data(), sizeof(uint16_t), rows, out);
+  ok &= rows == fwrite(columns.session.data(), sizeof(uint16_t), rows, out);
+  ok &= rows == fwrite(columns.tacho_period_min.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.tacho_period_max.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.tacho_period_last.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.speedo_period_min.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.speedo_period_max.data(), sizeof(uint32_t), rows, out);
+  ok &= rows == fwrite(columns.speedo_period_last.data(), sizeof(uint32_t), rows, out);
+  return (0 == fclose(out)) && ok;
+}
+
+bool unframe_dump(const char *capture_path, const char *image_path, std::vector<uint32_t> *bad_addresses) {
+  /* Turn a serial capture of the logger's dump command back into a flash
+    image. Frames are COBS encoded, [address][data][crc16], ending in a frame
+    with no data. Bytes from frames that fail their CRC stay 0xff, and the
+    address of the frame before each one is noted so it can be dumped again.
+  */
+  FILE *in = fopen(capture_path, "rb");
+  if (NULL == in)
+    return false;
+  std::vector<uint8_t> capture;
+  uint8_t buffer[1 << 16];
+  for (size_t len; 0 != (len = fread(buffer, 1, sizeof(buffer), in));)
+    capture.insert(capture.end(), buffer, buffer + len);
+  fclose(in);
+  // skip the text line the logger prints before it changes baud rate
+  size_t offset = 0;
+  if ((capture.size() > 4) && (0 == memcmp(capture.data(), "dump", 4))) {
+    while ((offset < capture.size()) && ('\n' != capture[offset]))
+      offset++;
+    offset++;
+  }
+  std::vector<uint8_t> image;
+  uint32_t last_good = 0;
+  uint8_t frame[256];
+  while (offset < capture.size()) {
+    // COBS decode up to the next zero
+    size_t len = 0;
+    bool ok = true;
+    while ((offset < capture.size()) && (0 != capture[offset])) {
+      uint8_t code = capture[offset++];
+      for (uint8_t ctr = 1; ctr < code; ctr++) {
+        if ((offset >= capture.size()) || (0 == capture[offset]) || (len >= sizeof(frame))) {
+          ok = false;
+          break;
+        }
+        frame[len++] = capture[offset++];
+      }
+      if (!ok)
+        break;
+      if ((code < 0xff) && (offset < capture.size()) && (0 != capture[offset]) && (len < sizeof(frame)))
+        frame[len++] = 0;
+    }
+    while ((offset < capture.size()) && (0 != capture[offset]))
+      offset++;
+    offset++;
+    if (0 == len)
+      continue;
+    if (!ok || (len < 6) || (read_u16(frame + len - 2) != calculate_crc16(frame, len - 2))) {
+      bad_addresses->push_back(last_good);
+      continue;
+    }
+    uint32_t address = read_u32(frame);
+    size_t data_len = len - 6;
+    if (0 == data_len)
+      break;  // the end frame
+    if (image.size() < address + data_len)
+      image.resize(address + data_len, 0xff);
+    memcpy(image.data() + address, frame + 4, data_len);
+    last_good = address + data_len;
+  }
+  FILE *out = fopen(image_path, "wb");
+  if (NULL == out)
+    return false;
+  bool ok = image.size() == fwrite(image.data(), 1, image.size(), out);
+  return (0 == fclose(out)) && ok;
+}
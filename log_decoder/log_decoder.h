@@ -0,0 +1,99 @@
+/*
+Decode flash images dumped from gears_logger on a host machine.
+*/
+
+#ifndef LOG_DECODER_H
+#define LOG_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// these mirror gears_logger.ino and the WinbondFlash library
+const uint8_t FILE_HEADER_MAGIC_BYTES[] = {0xbe, 0xeb, 0xee, 0x1a, 0x2b, 0x3c, 0xee, 0x77};
+const size_t FILE_HEADER_MAGIC_LEN = 8;
+const size_t FILE_HEADER_TOTAL_LEN = 32;
+const size_t DATA_RECORD_LEN = 11;  // FILE_FORMAT_VERSION 1
+const uint8_t PACKED_BLOCK_MARKER = 0xb2;  // FILE_FORMAT_VERSION 2 and up
+const uint8_t COMPRESSED_BLOCK_MARKER = 0xb3;  // FILE_FORMAT_VERSION 6 and up
+const uint8_t PACKED_TIME = 0x01;
+const uint8_t PACKED_TACHO = 0x02;
+const uint8_t PACKED_SPEEDO = 0x04;
+const uint8_t PACKED_NEUTRAL = 0x08;
+const uint8_t PACKED_TACHO_PERIOD = 0x10;
+const uint8_t PACKED_SPEEDO_PERIOD = 0x20;
+const uint8_t PACKED_SAMPLES_MISSED = 0x40;
+const uint8_t PACKED_SAMPLE_LATENCY = 0x80;  // FILE_FORMAT_VERSION 7 and up, in a second mask byte
+const uint16_t PACKED_TACHO_RANGE = 0x100;  // then 0x200 and 0x400, version 7 and up, against the mean period from 8
+const uint16_t PACKED_SPEEDO_RANGE = 0x800;  // and 0x1000 and 0x2000
+const uint8_t COMMIT_MARKER = 0xc3;  // FILE_FORMAT_VERSION 5 and up
+const uint8_t COMMIT_MAGIC = 0x5e;
+const size_t COMMIT_MARKER_BYTES = 9;
+const size_t FLASH_SECTOR_BYTES = 4096;
+const uint8_t DIRECTORY_MAGIC_BYTES[] = {0xd1, 0x5e, 0xc7, 0x0e, 0x1a, 0x2b, 0x3c, 0xdd};
+const size_t DIRECTORY_SECTORS = 2;
+const size_t DIRECTORY_ENTRY_BYTES = 16;
+
+struct Session {
+  size_t header_address;  // where the FileHeader is
+  size_t length;  // in bytes, the header included - may wrap around the end of the ring
+  bool from_directory;  // is the length from the session directory, or a guess?
+  uint8_t record_version;
+  uint8_t record_len;
+  uint16_t sample_period;  // milliseconds
+};
+
+struct Columns {
+  std::vector<uint32_t> time;  // millis() on the logger
+  std::vector<uint16_t> tacho;
+  std::vector<uint16_t> speedo;
+  std::vector<uint16_t> neutral;
+  std::vector<uint32_t> tacho_period;  // microseconds, zero if not captured or before version 3
+  std::vector<uint32_t> speedo_period;
+  std::vector<uint8_t> samples_missed;  // sample clock ticks skipped, version 4 on
+  std::vector<uint16_t> sample_latency;  // microseconds from the tick to the record, version 4 on
+  std::vector<uint32_t> tacho_period_min;  // microseconds, the shortest single period over the sample, version 7 on
+  std::vector<uint32_t> tacho_period_max;
+  std::vector<uint32_t> tacho_period_last;
+  std::vector<uint32_t> speedo_period_min;
+  std::vector<uint32_t> speedo_period_max;
+  std::vector<uint32_t> speedo_period_last;
+  std::vector<uint16_t> session;  // index into the session list
+
+  size_t size(void) const { return time.size(); }
+  void append(const Columns &other);
+};
+
+struct DecodeStats {
+  size_t records;
+  size_t bad_records;  // version 1 records with a bad check byte
+  size_t bad_blocks;  // version 2 blocks that did not decode, skipped over
+};
+
+class LogImage {
+  public:
+    LogImage();
+    ~LogImage();
+    bool open(const char *path);
+    const uint8_t *data(void) const { return image; }
+    size_t size(void) const { return image_len; }
+    size_t data_start(void) const { return ring_start; }
+    std::vector<Session> find_sessions(unsigned int threads);
+    Columns decode(const std::vector<Session> &sessions, unsigned int threads, DecodeStats *stats) const;
+
+  private:
+    void read_directory(std::vector<Session> *sessions);
+
+    int fd;
+    const uint8_t *image;
+    size_t image_len;
+    size_t ring_start;  // where the logged data starts, after any directory
+};
+
+uint8_t calculate_crc(const uint8_t *data, size_t len);
+uint16_t calculate_crc16(const uint8_t *data, size_t len);
+bool write_csv(const char *path, const Columns &columns);
+bool write_columnar(const char *path, const Columns &columns);
+bool unframe_dump(const char *capture_path, const char *image_path, std::vector<uint32_t> *bad_addresses);
+
+#endif
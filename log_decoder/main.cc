@@ -0,0 +1,93 @@
+/*
+Decode a gears_logger flash image into CSV or columnar binary.
+
+Build with:
+  g++ -O2 -std=c++11 -pthread -o log_decoder main.cc log_decoder.cc
+
+Usage:
+  log_decoder [-j threads] [-l] [-c out.csv] [-b out.col] image.bin
+  log_decoder -u capture.bin image.bin
+
+-l lists the sessions found. -u turns a serial capture of the logger's dump
+command into an image, listing the addresses to dump again if any frames
+were corrupted.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include "log_decoder.h"
+
+static void usage(void) {
+  fprintf(stderr, "usage: log_decoder [-j threads] [-l] [-c out.csv] [-b out.col] image.bin\n");
+  fprintf(stderr, "       log_decoder -u capture.bin image.bin\n");
+  exit(1);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+  unsigned int threads = std::thread::hardware_concurrency();
+  bool list = false;
+  bool unframe = false;
+  const char *csv_path = NULL;
+  const char *columnar_path = NULL;
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "j:lc:b:u"))) {
+    switch (opt) {
+      case 'j': threads = atoi(optarg); break;
+      case 'l': list = true; break;
+      case 'c': csv_path = optarg; break;
+      case 'b': columnar_path = optarg; break;
+      case 'u': unframe = true; break;
+      default: usage();
+    }
+  }
+  if (unframe) {
+    if (argc - optind != 2)
+      usage();
+    std::vector<uint32_t> bad_addresses;
+    if (!unframe_dump(argv[optind], argv[optind + 1], &bad_addresses)) {
+      fprintf(stderr, "could not unframe %s into %s\n", argv[optind], argv[optind + 1]);
+      return 1;
+    }
+    for (size_t ctr = 0; ctr < bad_addresses.size(); ctr++)
+      printf("bad frame after address %u, dump again from there\n", bad_addresses[ctr]);
+    return bad_addresses.empty() ? 0 : 2;
+  }
+  if (argc - optind != 1)
+    usage();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  LogImage image;
+  if (!image.open(argv[optind])) {
+    fprintf(stderr, "could not map %s\n", argv[optind]);
+    return 1;
+  }
+  std::vector<Session> sessions = image.find_sessions(threads);
+  DecodeStats stats;
+  Columns columns = image.decode(sessions, threads, &stats);
+  fprintf(stderr, "%zu bytes, %zu sessions, %zu records, %zu bad records, %zu bad blocks in %.3fs\n",
+    image.size(), sessions.size(), stats.records, stats.bad_records, stats.bad_blocks, seconds_since(start));
+  if (list) {
+    for (size_t ctr = 0; ctr < sessions.size(); ctr++) {
+      printf("session %zu: address(%zu) length(%zu%s) version(%u) record_len(%u) period(%u)\n", ctr,
+        sessions[ctr].header_address, sessions[ctr].length, sessions[ctr].from_directory ? "" : "?",
+        sessions[ctr].record_version, sessions[ctr].record_len, sessions[ctr].sample_period);
+    }
+  }
+  if ((NULL != csv_path) && !write_csv(csv_path, columns)) {
+    fprintf(stderr, "could not write %s\n", csv_path);
+    return 1;
+  }
+  if ((NULL != columnar_path) && !write_columnar(columnar_path, columns)) {
+    fprintf(stderr, "could not write %s\n", columnar_path);
+    return 1;
+  }
+  return 0;
+}
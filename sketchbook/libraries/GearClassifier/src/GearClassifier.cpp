@@ -0,0 +1,327 @@
+#include "GearClassifier.h"
+
+// GEAR_LUT_OCTAVE * log2(1 + m / 32) rounded down, for the five bits m after the top one
+const byte LOG_FRACTION[32] = {0, 1, 2, 4, 5, 6, 7, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+  18, 19, 20, 21, 22, 23, 24, 25, 25, 26, 27, 28, 29, 29, 30, 31};
+
+GearClassifier::GearClassifier(unsigned int tolerance_permille, byte max_gears) {
+  tolerance = tolerance_permille;
+  gear_limit = (max_gears < GEAR_MAX_GEARS) ? max_gears : GEAR_MAX_GEARS;
+  reset();
+}
+
+void GearClassifier::reset(void) {
+  /* Forget all the ratios, and anything learned towards new ones
+  */
+  for (byte ctr = 0; ctr < GEAR_MAX_GEARS; ctr++) {
+    ratios[ctr] = GEAR_NO_RATIO;
+    refine_tacho[ctr] = 0;
+    refine_speedo[ctr] = 0;
+    refine_time[ctr] = 0;
+  }
+  for (byte ctr = 0; ctr < GEAR_CANDIDATES; ctr++)
+    candidates[ctr].weight = 0;
+  num_ratios = 0;
+  changed = false;
+  update_bounds();
+}
+
+void GearClassifier::set_ratios(unsigned short *new_ratios, byte num) {
+  /* Load a table of ratios, say from EEPROM. They must be in increasing order.
+  */
+  reset();
+  for (byte ctr = 0; (ctr < num) && (ctr < gear_limit) && (GEAR_NO_RATIO != new_ratios[ctr]); ctr++) {
+    ratios[ctr] = new_ratios[ctr];
+    num_ratios++;
+  }
+  update_bounds();
+}
+
+void GearClassifier::update_bounds(void) {
+  /* Work out the bounds of each ratio once, when the table changes, so
+    classifying doesn't have to
+  */
+  for (byte ctr = 0; ctr < num_ratios; ctr++) {
+    lower[ctr] = ((unsigned long)ratios[ctr] * (1000 - tolerance) + 500) / 1000;
+    upper[ctr] = ((unsigned long)ratios[ctr] * (1000 + tolerance) + 500) / 1000;
+    hold_lower[ctr] = ((unsigned long)ratios[ctr] * (1000 - 2 * tolerance) + 500) / 1000;
+    hold_upper[ctr] = ((unsigned long)ratios[ctr] * (1000 + 2 * tolerance) + 500) / 1000;
+  }
+  update_lut();
+}
+
+int GearClassifier::log_index(unsigned int value) {
+  /* About GEAR_LUT_OCTAVE * log2(value), never over and less than 2.2
+    under. Zero for zero.
+  */
+  if (0 == value)
+    return 0;
+  byte top_bit = 0;
+  for (unsigned int shifted = value >> 1; 0 != shifted; shifted >>= 1)
+    top_bit++;
+  byte fraction = (top_bit >= 5) ? (value >> (top_bit - 5)) & 31 : (value << (5 - top_bit)) & 31;
+  return top_bit * GEAR_LUT_OCTAVE + LOG_FRACTION[fraction];
+}
+
+void GearClassifier::update_lut(void) {
+  /* Fill the lookup table from the bounds. A bucket is a range of
+    log_index(tacho) - log_index(speedo), and each gear covers the buckets its
+    bounds can land in, with a margin for the rounding in log_index(). Where
+    gears share a bucket the lowest one goes in, and classify() works up from
+    there.
+  */
+  for (unsigned int ctr = 0; ctr < GEAR_LUT_BUCKETS; ctr++)
+    lut[ctr] = GEAR_NONE;
+  lut_valid = true;
+  if (0 == num_ratios)
+    return;
+  int scale_index = log_index(GEAR_RATIO_SCALE);
+  lut_base = log_index(lower[0]) - scale_index - GEAR_LUT_MARGIN;
+  for (byte gear = num_ratios; gear > 0; gear--) {
+    int first = log_index(lower[gear - 1]) - scale_index - GEAR_LUT_MARGIN - lut_base;
+    int last = log_index(upper[gear - 1]) - scale_index + GEAR_LUT_MARGIN - lut_base;
+    if (last >= GEAR_LUT_BUCKETS) {
+      lut_valid = false;  // the gears are too far apart for the table
+      return;
+    }
+    for (int bucket = first; bucket <= last; bucket++)
+      lut[bucket] = gear - 1;
+  }
+}
+
+
+byte GearClassifier::classify(unsigned int tacho, unsigned int speedo) {
+  /* Which known gear do these counts match, or GEAR_NONE? A ratio matches if
+    lower < tacho / speedo <= upper, which is tested by multiplying out
+    rather than dividing. The lookup table gives the first gear to try, so
+    only one or two are tested however many there are.
+  */
+  if ((0 == tacho) || (0 == speedo))
+    return GEAR_NONE;
+  while (speedo > 0x7fff) {
+    // keep the biggest bound times speedo inside 32 bits
+    speedo >>= 1;
+    tacho >>= 1;
+  }
+  unsigned long scaled_tacho = tacho * GEAR_RATIO_SCALE;
+  if (!lut_valid)
+    return classify_from(0, scaled_tacho, speedo);
+  int bucket = log_index(tacho) - log_index(speedo) - lut_base;
+  if ((bucket < 0) || (bucket >= GEAR_LUT_BUCKETS) || (GEAR_NONE == lut[bucket]))
+    return GEAR_NONE;
+  return classify_from(lut[bucket], scaled_tacho, speedo);
+}
+
+byte GearClassifier::classify_from(byte gear, unsigned long scaled_tacho, unsigned int speedo) {
+  /* Test the gears from the given one up. The bounds go up with the gears,
+    so stop at the first one whose lower bound the ratio isn't over.
+  */
+  for (; (gear < num_ratios) && (lower[gear] * speedo < scaled_tacho); gear++) {
+    if (scaled_tacho <= upper[gear] * speedo)
+      return gear;
+  }
+  return GEAR_NONE;
+}
+
+byte GearClassifier::update(unsigned int tacho, unsigned int speedo, unsigned int span_ms) {
+  /* Classify the counts from one window and learn from them. A window in a
+    known gear refines its ratio, one that isn't counts towards a candidate
+    ratio becoming a gear. Zero counts, stopped or coasting, only age the
+    candidates. The span is the milliseconds the counts stand for, so
+    learning takes as long however often this is called. Returns the gear,
+    or GEAR_NONE.
+  */
+  if (0 == span_ms)
+    span_ms = 1;
+  else if (span_ms > GEAR_MAX_SPAN_MS)
+    span_ms = GEAR_MAX_SPAN_MS;
+  byte gear = classify(tacho, speedo);
+  if (GEAR_NONE != gear) {
+    age_candidates(NULL, span_ms);
+    refine(gear, tacho, speedo, span_ms);
+  }
+  else if ((0 == tacho) || (0 == speedo))
+    age_candidates(NULL, span_ms);
+  else
+    learn(tacho, speedo, span_ms);
+  return gear;
+}
+
+bool GearClassifier::holds_gear(byte gear, unsigned int tacho, unsigned int speedo) {
+  /* Are the counts within twice the tolerance of the given gear? Once in a
+    gear this is what it takes to leave it, so a ratio near the edge of the
+    tolerance doesn't flicker in and out.
+  */
+  if ((gear >= num_ratios) || (0 == tacho) || (0 == speedo))
+    return false;
+  while (speedo > 0x7fff) {
+    speedo >>= 1;
+    tacho >>= 1;
+  }
+  unsigned long scaled_tacho = tacho * GEAR_RATIO_SCALE;
+  return (hold_lower[gear] * speedo < scaled_tacho) && (scaled_tacho <= hold_upper[gear] * speedo);
+}
+
+bool GearClassifier::take_changed(void) {
+  /* Has a gear been learned, or a ratio moved by GEAR_SAVE_PERMILLE, since
+    this was last called? If so the table is worth saving.
+  */
+  bool rv = changed;
+  changed = false;
+  return rv;
+}
+
+void GearClassifier::learn(unsigned int tacho, unsigned int speedo, unsigned int span_ms) {
+  /* Add an unmatched window to the candidate with its ratio, or start a new
+    candidate in a free slot or over the lightest one. Only this takes a
+    divide, and only when the gear isn't known.
+  */
+  unsigned short new_ratio = ratio(tacho, speedo);
+  GearCandidate *candidate = NULL;
+  GearCandidate *lightest = &candidates[0];
+  for (byte ctr = 0; ctr < GEAR_CANDIDATES; ctr++) {
+    if ((0 != candidates[ctr].weight) && near_ratio(new_ratio, candidates[ctr].centre, tolerance)) {
+      candidate = &candidates[ctr];
+      break;
+    }
+    if (candidates[ctr].weight < lightest->weight)
+      lightest = &candidates[ctr];
+  }
+  if (NULL == candidate) {
+    candidate = lightest;
+    candidate->tacho_sum = 0;
+    candidate->speedo_sum = 0;
+    candidate->weight = 0;
+  }
+  age_candidates(candidate, span_ms);
+  if (candidate->speedo_sum > 0x3fffffff) {
+    // it has been around a long time without being promoted, keep the sums in range
+    candidate->tacho_sum >>= 1;
+    candidate->speedo_sum >>= 1;
+  }
+  candidate->tacho_sum += tacho;
+  candidate->speedo_sum += speedo;
+  candidate->centre = ratio(candidate->tacho_sum, candidate->speedo_sum);
+  candidate->weight += span_ms;
+  if (candidate->weight >= GEAR_PROMOTE_MS)
+    promote(candidate);
+}
+
+void GearClassifier::promote(GearCandidate *candidate) {
+  /* Make a candidate that has turned up often enough a gear. One close to a
+    known gear is just the ragged edge of that gear, and is dropped.
+  */
+  candidate->weight = 0;
+  for (byte ctr = 0; ctr < num_ratios; ctr++) {
+    if (near_ratio(candidate->centre, ratios[ctr], 2 * tolerance))
+      return;
+  }
+  if (GEAR_NONE == insert_ratio(candidate->centre))
+    return;
+  changed = true;
+  for (byte ctr = 0; ctr < GEAR_MAX_GEARS; ctr++) {
+    // the gears above the new one have moved up, so start refining again
+    refine_tacho[ctr] = 0;
+    refine_speedo[ctr] = 0;
+    refine_time[ctr] = 0;
+  }
+}
+
+void GearClassifier::refine(byte gear, unsigned int tacho, unsigned int speedo, unsigned int span_ms) {
+  /* Add a window to its gear's sums, and every GEAR_REFINE_MS move the
+    gear's ratio a quarter of the way to the ratio of the sums. A move that
+    would take it past a neighbour is dropped.
+  */
+  refine_tacho[gear] += tacho;
+  refine_speedo[gear] += speedo;
+  refine_time[gear] += span_ms;
+  if (refine_time[gear] < GEAR_REFINE_MS)
+    return;
+  unsigned short measured = ratio(refine_tacho[gear], refine_speedo[gear]);
+  refine_tacho[gear] = 0;
+  refine_speedo[gear] = 0;
+  refine_time[gear] = 0;
+  unsigned short old_ratio = ratios[gear];
+  unsigned short new_ratio = (measured > old_ratio) ? old_ratio + (measured - old_ratio + 2) / 4 :
+    old_ratio - (old_ratio - measured + 2) / 4;
+  if (((gear > 0) && (new_ratio <= ratios[gear - 1])) || ((gear + 1 < num_ratios) && (new_ratio >= ratios[gear + 1])))
+    return;
+  if (new_ratio == old_ratio)
+    return;
+  ratios[gear] = new_ratio;
+  update_bounds();
+  if (!near_ratio(new_ratio, old_ratio, GEAR_SAVE_PERMILLE))
+    changed = true;
+}
+
+void GearClassifier::age_candidates(GearCandidate *except, unsigned int span_ms) {
+  /* Every candidate but the given one loses half the span, at least a
+    millisecond, so one seen less than a third of the time never gets there
+  */
+  unsigned int loss = (span_ms + 1) / 2;
+  for (byte ctr = 0; ctr < GEAR_CANDIDATES; ctr++) {
+    if (&candidates[ctr] != except)
+      candidates[ctr].weight = (candidates[ctr].weight > loss) ? candidates[ctr].weight - loss : 0;
+  }
+}
+
+bool GearClassifier::near_ratio(unsigned short ratio_a, unsigned short ratio_b, unsigned int permille) {
+  /* Is one ratio within the given parts per thousand of the other?
+  */
+  unsigned long difference = (ratio_a > ratio_b) ? ratio_a - ratio_b : ratio_b - ratio_a;
+  return difference * 1000 <= (unsigned long)ratio_b * permille;
+}
+
+byte GearClassifier::add_ratio(unsigned int tacho, unsigned int speedo) {
+  /* Add the ratio of counts straight in as a new gear, without waiting for
+    it to turn up again. Returns the new gear, or GEAR_NONE if the table is
+    full or the counts are no good.
+  */
+  if ((0 == tacho) || (0 == speedo))
+    return GEAR_NONE;
+  return insert_ratio(ratio(tacho, speedo));
+}
+
+byte GearClassifier::insert_ratio(unsigned short new_ratio) {
+  /* Put a new ratio in the table, keeping it in order
+  */
+  if (num_ratios >= gear_limit)
+    return GEAR_NONE;
+  byte new_gear = 0;
+  while ((new_gear < num_ratios) && (ratios[new_gear] < new_ratio))
+    new_gear++;
+  for (byte ctr = num_ratios; ctr > new_gear; ctr--)
+    ratios[ctr] = ratios[ctr - 1];
+  ratios[new_gear] = new_ratio;
+  num_ratios++;
+  update_bounds();
+  return new_gear;
+}
+
+byte GearClassifier::num_gears(void) {
+  /* How many ratios are known?
+  */
+  return num_ratios;
+}
+
+unsigned short GearClassifier::get_ratio(byte gear) {
+  /* The ratio of the given gear, scaled by GEAR_RATIO_SCALE
+  */
+  if (gear >= num_ratios)
+    return GEAR_NO_RATIO;
+  return ratios[gear];
+}
+
+unsigned short GearClassifier::ratio(unsigned long tacho, unsigned long speedo) {
+  /* Tacho over speedo scaled by GEAR_RATIO_SCALE and rounded, as stored in
+    the table. This is the one divide, so only use it off the fast path.
+  */
+  while (tacho > 0xffffffffUL / GEAR_RATIO_SCALE) {
+    tacho >>= 1;
+    speedo >>= 1;
+  }
+  if (0 == speedo)
+    return GEAR_NO_RATIO;
+  unsigned long scaled = ((unsigned long)tacho * GEAR_RATIO_SCALE + speedo / 2) / speedo;
+  return (scaled < GEAR_NO_RATIO) ? scaled : GEAR_NO_RATIO - 1;
+}
@@ -0,0 +1,83 @@
+/*
+Work out the gear from the tacho and speedo counts, learning the gearbox's
+ratios as new ones turn up. A ratio that doesn't match a gear has to keep
+turning up before it becomes one, so clutch slip, wheelspin and the odd
+noisy window are ignored. Integer only, for chips without an FPU.
+*/
+
+#ifndef GEAR_CLASSIFIER_H
+#define GEAR_CLASSIFIER_H
+
+#ifdef ARDUINO
+#include "Arduino.h"
+#else
+#include <stddef.h>  // building the tests on a host
+#ifndef byte
+typedef unsigned char byte;
+#endif
+#endif
+
+#define GEAR_MAX_GEARS 9
+#define GEAR_NONE 255
+#define GEAR_RATIO_SCALE 1000UL  // ratios are tacho over speedo multiplied by this, so they fit in an unsigned short
+#define GEAR_NO_RATIO 65535  // what a blank EEPROM hands back
+#define GEAR_LUT_BUCKETS 256  // the lookup table of ratio to gear
+#define GEAR_LUT_OCTAVE 32  // buckets for each doubling of the ratio, so 8 octaves in all
+#define GEAR_LUT_MARGIN 5  // buckets either side of a gear, for the rounding in log_index()
+#define GEAR_CANDIDATES 4  // unmatched ratios watched at once
+#define GEAR_UPDATE_MS 500  // what an update counts for when the caller doesn't say, the gears sketch's window
+#define GEAR_MAX_SPAN_MS 1000  // the most one update counts for, so a gap between updates isn't taken as time in one ratio
+#define GEAR_PROMOTE_MS 3000  // milliseconds a candidate's ratio has to be seen for to become a gear, less half of any other time
+#define GEAR_REFINE_MS 16000  // milliseconds in a gear between refining its ratio
+#define GEAR_SAVE_PERMILLE 10  // a refinement moving a ratio this much makes the table worth saving
+
+struct GearCandidate {
+  unsigned long tacho_sum;  // over the windows with this ratio
+  unsigned long speedo_sum;
+  unsigned short centre;  // the ratio of the sums
+  unsigned int weight;  // milliseconds, zero for a free slot
+};
+
+class GearClassifier {
+  public:
+    GearClassifier(unsigned int tolerance_permille, byte max_gears = GEAR_MAX_GEARS);
+    void reset(void);
+    void set_ratios(unsigned short *new_ratios, byte num);
+    byte classify(unsigned int tacho, unsigned int speedo);
+    byte update(unsigned int tacho, unsigned int speedo, unsigned int span_ms = GEAR_UPDATE_MS);
+    bool take_changed(void);
+    bool holds_gear(byte gear, unsigned int tacho, unsigned int speedo);
+    byte add_ratio(unsigned int tacho, unsigned int speedo);
+    byte num_gears(void);
+    unsigned short get_ratio(byte gear);
+    static unsigned short ratio(unsigned long tacho, unsigned long speedo);
+    static int log_index(unsigned int value);
+  private:
+    byte insert_ratio(unsigned short new_ratio);
+    void learn(unsigned int tacho, unsigned int speedo, unsigned int span_ms);
+    void promote(GearCandidate *candidate);
+    void refine(byte gear, unsigned int tacho, unsigned int speedo, unsigned int span_ms);
+    void age_candidates(GearCandidate *except, unsigned int span_ms);
+    bool near_ratio(unsigned short ratio_a, unsigned short ratio_b, unsigned int permille);
+    void update_bounds(void);
+    void update_lut(void);
+    byte classify_from(byte gear, unsigned long scaled_tacho, unsigned int speedo);
+    unsigned short ratios[GEAR_MAX_GEARS];  // in increasing order
+    unsigned long lower[GEAR_MAX_GEARS];  // each ratio less the tolerance, scaled the same
+    unsigned long upper[GEAR_MAX_GEARS];  // plus the tolerance
+    unsigned long hold_lower[GEAR_MAX_GEARS];  // twice the tolerance, to stay in a gear once in it
+    unsigned long hold_upper[GEAR_MAX_GEARS];
+    byte num_ratios;
+    byte lut[GEAR_LUT_BUCKETS];  // the lowest gear that could match a bucket, or GEAR_NONE
+    int lut_base;  // the log_index() difference of bucket zero
+    bool lut_valid;  // false if the gears span more than the table, so search them all
+    unsigned int tolerance;  // parts per thousand either side of a ratio
+    byte gear_limit;  // the most gears to learn
+    bool changed;  // since take_changed() was last called
+    GearCandidate candidates[GEAR_CANDIDATES];
+    unsigned long refine_tacho[GEAR_MAX_GEARS];  // summed over the windows in each gear since it was last refined
+    unsigned long refine_speedo[GEAR_MAX_GEARS];
+    unsigned int refine_time[GEAR_MAX_GEARS];  // milliseconds
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "GearFilter.h"
+
+GearFilter::GearFilter(GearClassifier *gear_classifier, unsigned int min_speedo, unsigned long hold_ms) {
+  classifier = gear_classifier;
+  speedo_floor = min_speedo;
+  hold_time = hold_ms;
+  reset();
+}
+
+void GearFilter::reset(void) {
+  /* Start again with no gear shown
+  */
+  history_len = 0;
+  history_next = 0;
+  state = GEAR_IDLE;
+  shown = GEAR_NONE;
+  candidate = GEAR_NONE;
+  candidate_start = 0;
+  shown_start = 0;
+  hold_start = 0;
+  last_update = 0;
+  updated = false;
+}
+
+byte GearFilter::update(unsigned int tacho, unsigned int speedo, unsigned long time_now) {
+  /* Take the counts from one window and return the gear to show. The
+    classifier learns from the filtered counts. Anything whose ratio is
+    tacho over speedo will do as counts, periods turned around say. The
+    time, in milliseconds, times the holds and how long a gear has been
+    seen, and tells the classifier how long the counts stand for, so it
+    all takes as long whether this is called every window or every speedo
+    period.
+  */
+  unsigned long span = updated ? time_now - last_update : GEAR_UPDATE_MS;
+  if (span > GEAR_MAX_SPAN_MS)
+    span = GEAR_MAX_SPAN_MS;
+  last_update = time_now;
+  updated = true;
+  if ((0 == tacho) || (speedo < speedo_floor))
+    return hold(time_now);
+  history_tacho[history_next] = tacho;
+  history_speedo[history_next] = speedo;
+  history_next = (history_next + 1) % GEAR_MEDIAN_WINDOWS;
+  if (history_len < GEAR_MEDIAN_WINDOWS)
+    history_len++;
+  median(&tacho, &speedo);
+  byte gear = classifier->update(tacho, speedo, span);
+  if ((GEAR_NONE != shown) && (gear != shown) && classifier->holds_gear(shown, tacho, speedo))
+    gear = shown;  // not far enough out of the shown gear to leave it
+  if (GEAR_NONE == gear)
+    return hold(time_now);
+  if (gear == shown) {
+    state = GEAR_ENGAGED;
+    candidate = GEAR_NONE;
+    return shown;
+  }
+  if (gear != candidate) {
+    candidate = gear;
+    candidate_start = time_now;
+  }
+  // coming out of a hold the shift is done, so there is no need to wait
+  if ((GEAR_ENGAGED != state) ||
+      ((time_now - candidate_start >= GEAR_ENTER_MS) && (time_now - shown_start >= GEAR_MIN_DWELL_MS))) {
+    shown = gear;
+    state = GEAR_ENGAGED;
+    candidate = GEAR_NONE;
+    shown_start = time_now;
+  }
+  return shown;
+}
+
+byte GearFilter::update_period(unsigned long speedo_period, unsigned int tacho_edges, unsigned long tacho_span,
+    unsigned long time_now) {
+  /* Take one speedo period, and the tacho edges over the span from the first
+    to the last of them, as PERIOD_DETECTION times them, and return the gear
+    to show. Any clock will do for the periods, so long as both use it.
+  */
+  unsigned int tacho;
+  unsigned int speedo;
+  period_counts(speedo_period, tacho_edges, tacho_span, &tacho, &speedo);
+  return update(tacho, speedo, time_now);
+}
+
+bool GearFilter::stalled(unsigned long time_now) {
+  /* Call this while waiting for update_period(). With no update for
+    GEAR_SPEEDO_TIMEOUT_MS the bike is taken as stopped, and the filter told
+    so every timeout until it moves again. Returns true when it is, so the
+    caller can start timing its periods afresh.
+  */
+  if (updated && (time_now - last_update < GEAR_SPEEDO_TIMEOUT_MS))
+    return false;
+  update(0, 0, time_now);
+  return true;
+}
+
+void GearFilter::period_counts(unsigned long speedo_period, unsigned int tacho_edges, unsigned long tacho_span,
+    unsigned int *tacho, unsigned int *speedo) {
+  /* The ratio is the speedo period over the mean tacho period, so
+    speedo_period * tacho_edges / tacho_span. Hand those over as the counts,
+    shifted down together into 16 bits. No span gives no tacho count, which
+    update() takes as stopped.
+  */
+  unsigned long scaled_tacho = speedo_period * tacho_edges;
+  while ((scaled_tacho > 0xffff) || (tacho_span > 0xffff)) {
+    scaled_tacho >>= 1;
+    tacho_span >>= 1;
+  }
+  *tacho = (0 == tacho_span) ? 0 : scaled_tacho;
+  *speedo = tacho_span;
+}
+
+byte GearFilter::hold(unsigned long time_now) {
+  /* No ratio to go on, so keep showing the last gear for a while, then
+    nothing. The median starts again afterwards, so the new gear after a
+    shift shows straight away.
+  */
+  history_len = 0;
+  candidate = GEAR_NONE;
+  if (GEAR_NONE == shown)
+    return shown;
+  if (GEAR_HOLD != state) {
+    state = GEAR_HOLD;
+    hold_start = time_now;
+  }
+  else if (time_now - hold_start >= hold_time) {
+    shown = GEAR_NONE;
+    state = GEAR_IDLE;
+  }
+  return shown;
+}
+
+void GearFilter::median(unsigned int *tacho, unsigned int *speedo) {
+  /* Replace the counts with the median of the windows in the history, by
+    ratio. The ratios are compared by multiplying out. Until the history
+    fills up the newest window is used as it is.
+  */
+  if (history_len < GEAR_MEDIAN_WINDOWS)
+    return;
+  byte below[GEAR_MEDIAN_WINDOWS];
+  for (byte ctr = 0; ctr < GEAR_MEDIAN_WINDOWS; ctr++) {
+    below[ctr] = 0;
+    for (byte other = 0; other < GEAR_MEDIAN_WINDOWS; other++) {
+      unsigned long this_cross = (unsigned long)history_tacho[ctr] * history_speedo[other];
+      unsigned long other_cross = (unsigned long)history_tacho[other] * history_speedo[ctr];
+      if ((other_cross < this_cross) || ((other_cross == this_cross) && (other < ctr)))
+        below[ctr]++;
+    }
+  }
+  for (byte ctr = 0; ctr < GEAR_MEDIAN_WINDOWS; ctr++) {
+    if (GEAR_MEDIAN_WINDOWS / 2 == below[ctr]) {
+      *tacho = history_tacho[ctr];
+      *speedo = history_speedo[ctr];
+      return;
+    }
+  }
+}
+
+byte GearFilter::get_gear(void) {
+  /* The gear being shown, or GEAR_NONE
+  */
+  return shown;
+}
+
+GearState GearFilter::get_state(void) {
+  /* Idle, engaged or holding
+  */
+  return state;
+}
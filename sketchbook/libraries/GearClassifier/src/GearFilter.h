@@ -0,0 +1,57 @@
+/*
+Steady the gear shown to the rider. Each window's counts go through a
+median filter, then the classifier, then a state machine that holds the
+gear through shifts, clutch-in and coasting, and needs a new gear to be
+seen for a while before it is shown.
+*/
+
+#ifndef GEAR_FILTER_H
+#define GEAR_FILTER_H
+
+#include "GearClassifier.h"
+
+#define GEAR_MEDIAN_WINDOWS 3  // windows the median is taken over
+#define GEAR_ENTER_MS 500  // how long a different gear has to be seen for, straight from another gear
+#define GEAR_MIN_DWELL_MS 500  // how long the shown gear stays for at least, straight from another gear
+#define GEAR_HOLD_MS 3000  // how long the last gear is held with the clutch in or coasting, before it drops to GEAR_NONE
+#define GEAR_SPEEDO_TIMEOUT_MS 250  // without a speedo period for this long, the bike is taken as stopped
+
+enum GearState {
+  GEAR_IDLE,  // no gear shown, stopped or not known yet
+  GEAR_ENGAGED,  // the shown gear is being ridden in
+  GEAR_HOLD  // clutch in, coasting or mid-shift - the last gear is still shown
+};
+
+class GearFilter {
+  public:
+    GearFilter(GearClassifier *gear_classifier, unsigned int min_speedo, unsigned long hold_ms = GEAR_HOLD_MS);
+    void reset(void);
+    byte update(unsigned int tacho, unsigned int speedo, unsigned long time_now);
+    byte update_period(unsigned long speedo_period, unsigned int tacho_edges, unsigned long tacho_span,
+      unsigned long time_now);
+    bool stalled(unsigned long time_now);
+    static void period_counts(unsigned long speedo_period, unsigned int tacho_edges, unsigned long tacho_span,
+      unsigned int *tacho, unsigned int *speedo);
+    byte get_gear(void);
+    GearState get_state(void);
+  private:
+    void median(unsigned int *tacho, unsigned int *speedo);
+    byte hold(unsigned long time_now);
+    GearClassifier *classifier;
+    unsigned int speedo_floor;  // counts a window below which the bike is as good as stopped
+    unsigned long hold_time;  // milliseconds
+    unsigned int history_tacho[GEAR_MEDIAN_WINDOWS];  // the last windows since the ratio was last lost
+    unsigned int history_speedo[GEAR_MEDIAN_WINDOWS];
+    byte history_len;
+    byte history_next;
+    GearState state;
+    byte shown;  // the gear shown, or GEAR_NONE
+    byte candidate;  // a different gear seen in the last windows, or GEAR_NONE
+    unsigned long candidate_start;  // when it was first seen, by the caller's clock
+    unsigned long shown_start;  // when the shown gear changed
+    unsigned long hold_start;  // when the hold began
+    unsigned long last_update;
+    bool updated;  // since the reset, so last_update means something
+};
+
+#endif
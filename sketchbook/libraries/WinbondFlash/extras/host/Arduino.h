@@ -0,0 +1,43 @@
+/*
+Just enough of the Arduino core to build FlashBase, SessionDirectory and
+FileFlash on a host machine. Time is virtual: it only moves when the
+simulated flash chip says an operation took time, and by a microsecond each
+time micros() is read, like a busy loop would on the board.
+*/
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F(text) text  // strings stay in RAM on the host
+#define PSTR(text) text
+#define sprintf_P sprintf
+
+extern unsigned long host_micros;  // the virtual clock
+
+inline unsigned long micros(void) { return ++host_micros; }
+inline unsigned long millis(void) { return host_micros / 1000; }
+inline void delay(unsigned long ms) { host_micros += ms * 1000; }
+inline void delayMicroseconds(unsigned int us) { host_micros += us; }
+
+class HostSerial {
+  public:
+    void print(const char *text) { fputs(text, stdout); }
+    void print(long value) { printf("%ld", value); }
+    void print(unsigned long value) { printf("%lu", value); }
+    void print(int value) { printf("%d", value); }
+    void print(unsigned int value) { printf("%u", value); }
+    template <typename T> void println(T value) { print(value); println(); }
+    void println(void) { putchar('\n'); }
+};
+
+extern HostSerial Serial;
+
+#endif
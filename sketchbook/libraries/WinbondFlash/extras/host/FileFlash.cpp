@@ -0,0 +1,274 @@
+#include "FileFlash.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+unsigned long host_micros = 0;
+HostSerial Serial;
+
+FileFlash::FileFlash(const char *path, unsigned long len, const FlashTiming &flash_timing) {
+  /* Map the image file as the chip's memory. A new file, or the part of one
+    past its old end, starts out erased.
+  */
+  static char host_debug_string[200];
+  debug_string = host_debug_string;
+  len_bytes = len;
+  timing = flash_timing;
+  memory = NULL;
+  strict = false;
+  erase_until = 0;
+  program_until = 0;
+  suspended = false;
+  erase_len = 0;
+  program_len = 0;
+  reset_stats();
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if ((fd < 0) || (0 != fstat(fd, &st)) || (0 != ftruncate(fd, len)))
+    return;
+  void *mapped = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == mapped)
+    return;
+  memory = (byte*)mapped;
+  if ((unsigned long)st.st_size < len)
+    memset(memory + st.st_size, 0xff, len - st.st_size);
+}
+
+FileFlash::~FileFlash() {
+  /* Unmap the image, which leaves whatever was programmed in the file
+  */
+  if (NULL != memory)
+    munmap(memory, len_bytes);
+  if (fd >= 0)
+    close(fd);
+}
+
+bool FileFlash::is_open(void) {
+  /* Did the image file open and map?
+  */
+  return NULL != memory;
+}
+
+void FileFlash::reset_stats(void) {
+  /* Zero the operation counts
+  */
+  memset(&stats, 0, sizeof(stats));
+}
+
+void FileFlash::spi_time(unsigned long bytes) {
+  /* Move the clock on for one command with the given bytes of data
+  */
+  host_micros += timing.command + (bytes * FILE_FLASH_SPI_BYTE_NANOS + 999) / 1000;
+}
+
+bool FileFlash::chip_busy(void) {
+  /* Is a page program running, or an erase that isn't suspended? Finishing
+    one clears what it was working on.
+  */
+  if (host_micros < program_until)
+    return true;
+  program_len = 0;
+  if (suspended)
+    return false;
+  if (host_micros < erase_until)
+    return true;
+  erase_len = 0;
+  return false;
+}
+
+void FileFlash::violation(const char *what, unsigned long address) {
+  /* Note something a real chip would have ignored or got wrong
+  */
+  stats.violations++;
+  sprintf(debug_string, "flash violation: %s at %lu", what, address);
+  Serial.println(debug_string);
+  if (strict)
+    abort();
+}
+
+void FileFlash::read_raw(unsigned long address, byte *return_array, unsigned int length_to_read, FlashReadMode mode) {
+  /* Read from the image. Reads run off the end of the chip back to address
+    zero, as the chip does, but one starting past the end is a bug. The
+    sector or block being erased reads half erased.
+  */
+  if (chip_busy())
+    violation("read while busy", address);
+  else if (address >= len_bytes)
+    violation("read from past the end of the chip", address);
+  else if ((0 != erase_len) && (address < erase_address + erase_len) && (address + length_to_read > erase_address))
+    violation("read from a suspended erase", address);
+  for (unsigned int ctr = 0; ctr < length_to_read; ctr++) {
+    unsigned long cell = (address + ctr) % len_bytes;
+    bool half_erased = (0 != erase_len) && (cell >= erase_address) && (cell < erase_address + erase_len);
+    return_array[ctr] = half_erased ? (byte)(cell | 0x01) : memory[cell];
+  }
+  stats.reads++;
+  stats.read_bytes += length_to_read;
+  spi_time(((READ_NORMAL == mode) ? 4 : 5) + length_to_read);
+}
+
+void FileFlash::program_page(unsigned long address, byte *data, unsigned int length_to_write) {
+  /* Program bytes, which can only clear bits. Past the end of the page the
+    chip wraps around to the start of it.
+  */
+  spi_time(4 + length_to_write);
+  if (chip_busy()) {
+    violation("program while busy, ignored", address);
+    return;
+  }
+  if ((0 == length_to_write) || (length_to_write > FLASH_PAGE_BYTES) || (address >= len_bytes)) {
+    violation("program length or address", address);
+    return;
+  }
+  unsigned long page = address - (address % FLASH_PAGE_BYTES);
+  if ((0 != erase_len) && (page < erase_address + erase_len) && (page >= erase_address))
+    violation("program into a suspended erase", address);
+  if (address % FLASH_PAGE_BYTES + length_to_write > FLASH_PAGE_BYTES)
+    violation("program wrapped around its page", address);
+  bool cleared_only = true;
+  for (unsigned int ctr = 0; ctr < length_to_write; ctr++) {
+    byte *cell = memory + page + (address + ctr) % FLASH_PAGE_BYTES;
+    program_before[ctr] = *cell;
+    cleared_only &= (data[ctr] & *cell) == data[ctr];
+    *cell &= data[ctr];
+  }
+  if (!cleared_only)
+    violation("program over bits that were already cleared", address);
+  program_address = address;
+  program_len = length_to_write;
+  unsigned long program_time = timing.program_first_byte + (length_to_write - 1) * timing.program_next_byte;
+  program_until = host_micros + ((program_time < timing.page_program) ? program_time : timing.page_program);
+  stats.programs++;
+  stats.program_bytes += length_to_write;
+}
+
+void FileFlash::read_flash_info(byte *return_array) {
+  /* The manufacturer and device IDs of a W25Q64
+  */
+  spi_time(6);
+  return_array[0] = 0xff;
+  return_array[1] = 0xff;
+  return_array[2] = 0xff;
+  return_array[3] = 0xff;
+  return_array[4] = 0xef;
+  return_array[5] = 0x16;
+}
+
+void FileFlash::start_erase(unsigned long address, unsigned long erase_bytes) {
+  /* Erase a 4k sector, or a 32k or 64k block. The memory reads as erased
+    straight away, but the chip stays busy for the erase time.
+  */
+  spi_time(4);
+  if (chip_busy() || suspended) {
+    violation("erase while busy or suspended, ignored", address);
+    return;
+  }
+  unsigned long erase_time = timing.sector_erase;
+  if (FLASH_HALF_BLOCK_BYTES == erase_bytes)
+    erase_time = timing.block_erase_32k;
+  else if (FLASH_BLOCK_BYTES == erase_bytes)
+    erase_time = timing.block_erase_64k;
+  else if (FLASH_SECTOR_BYTES != erase_bytes) {
+    violation("erase size", address);
+    return;
+  }
+  erase_address = address - (address % erase_bytes);
+  erase_len = erase_bytes;
+  if (erase_address + erase_len > len_bytes)
+    erase_len = len_bytes - erase_address;
+  memset(memory + erase_address, 0xff, erase_len);
+  erase_until = host_micros + erase_time;
+  stats.erases++;
+}
+
+void FileFlash::erase_suspend(void) {
+  /* Suspend the erase in flight, keeping the time it still needs. The chip
+    ignores a suspend with no erase running, which happens when one ends
+    just before the command.
+  */
+  spi_time(1);
+  if (!chip_busy() || (0 == erase_len) || suspended)
+    return;
+  host_micros += timing.suspend;
+  suspended_left = (erase_until > host_micros) ? erase_until - host_micros : 0;
+  suspended = true;
+  stats.suspends++;
+}
+
+void FileFlash::erase_resume(void) {
+  /* Carry on with a suspended erase - ignored if there isn't one
+  */
+  spi_time(1);
+  if (!suspended)
+    return;
+  if (host_micros < program_until) {
+    violation("resume during a page program, ignored", program_address);
+    return;
+  }
+  suspended = false;
+  erase_until = host_micros + suspended_left;
+}
+
+byte FileFlash::read_status_reg1(void) {
+  /* BUSY is bit 0, the write enable latch bit 1
+  */
+  spi_time(2);
+  return chip_busy() ? 0x03 : 0x00;
+}
+
+byte FileFlash::read_status_reg2(void) {
+  /* SUS is bit 7
+  */
+  spi_time(2);
+  return suspended ? 0x80 : 0x00;
+}
+
+unsigned short FileFlash::read_status_reg_write(void) {
+  /* Both status registers, as written
+  */
+  return (read_status_reg2() << 8) | read_status_reg1();
+}
+
+bool FileFlash::busy(void) {
+  /* Is the chip busy? Polls the status register, as the real one does.
+  */
+  return read_status_reg1() & 0x01;
+}
+
+bool FileFlash::supports_read_mode(FlashReadMode mode) {
+  /* Normal and fast reads, at the clock the simulation runs
+  */
+  return (READ_NORMAL == mode) || (READ_FAST == mode);
+}
+
+bool FileFlash::erasing(void) {
+  /* Is there an erase running or suspended?
+  */
+  chip_busy();
+  return 0 != erase_len;
+}
+
+void FileFlash::power_cut(void) {
+  /* The power goes off. A page program in flight is left with only some of
+    its bits cleared, and an erase in flight leaves its sector neither erased
+    nor as it was. The chip is idle when the power comes back.
+  */
+  if (0 != program_len) {
+    for (unsigned int ctr = 0; ctr < program_len; ctr++) {
+      unsigned long cell = program_address - (program_address % FLASH_PAGE_BYTES) + (program_address + ctr) % FLASH_PAGE_BYTES;
+      if (ctr >= program_len / 2)
+        memory[cell] = program_before[ctr] & (memory[cell] | (byte)(0x5a << (ctr % 4)));
+    }
+  }
+  if (0 != erase_len) {
+    for (unsigned long ctr = 0; ctr < erase_len; ctr += 3)
+      memory[erase_address + ctr] = ctr;
+  }
+  erase_until = 0;
+  program_until = 0;
+  suspended = false;
+  erase_len = 0;
+  program_len = 0;
+}
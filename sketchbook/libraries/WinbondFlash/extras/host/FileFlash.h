@@ -0,0 +1,80 @@
+/*
+A simulated W25Q64-style NOR flash chip for host benchmarks and tests,
+backed by an mmapped image file of any size.
+*/
+
+#ifndef FILE_FLASH_H
+#define FILE_FLASH_H
+
+#include "Arduino.h"
+#include "FlashBase.h"
+
+#define FILE_FLASH_SPI_BYTE_NANOS 1000  // an 8MHz SPI clock, as an Uno at 16MHz runs it
+
+struct FlashTiming {  // microseconds, from the W25Q64 datasheet
+  unsigned long program_first_byte;
+  unsigned long program_next_byte;
+  unsigned long page_program;  // the most a page program takes, however it adds up
+  unsigned long sector_erase;  // 4k
+  unsigned long block_erase_32k;
+  unsigned long block_erase_64k;
+  unsigned long suspend;  // from the suspend command to the chip being ready
+  unsigned long command;  // chip select, command and address, besides the data bytes
+};
+
+const FlashTiming FLASH_TIMING_TYPICAL = {30, 2, 700, 45000, 120000, 150000, 20, 5};
+const FlashTiming FLASH_TIMING_WORST = {50, 12, 3000, 400000, 1600000, 2000000, 20, 5};
+
+struct FileFlashStats {
+  unsigned long reads;
+  unsigned long read_bytes;
+  unsigned long programs;
+  unsigned long program_bytes;
+  unsigned long erases;
+  unsigned long suspends;
+  unsigned long violations;  // things a real chip would not have done
+};
+
+class FileFlash final : public FlashBase {
+  public:
+    FileFlash(const char *path, unsigned long len, const FlashTiming &timing = FLASH_TIMING_TYPICAL);
+    ~FileFlash();
+    bool is_open(void);
+    void read_raw(unsigned long address, byte *return_array, unsigned int length_to_read, FlashReadMode mode);
+    void program_page(unsigned long address, byte *data, unsigned int length_to_write);
+    void read_flash_info(byte *return_array);
+    void start_erase(unsigned long address, unsigned long erase_bytes);
+    void erase_suspend(void);
+    void erase_resume(void);
+    byte read_status_reg1(void);
+    byte read_status_reg2(void);
+    unsigned short read_status_reg_write(void);
+    bool busy(void);
+    bool supports_read_mode(FlashReadMode mode);
+    bool erasing(void);
+    void power_cut(void);
+    void reset_stats(void);
+
+    FileFlashStats stats;
+    bool strict;  // abort on a violation, rather than count it
+
+  private:
+    void spi_time(unsigned long bytes);
+    bool chip_busy(void);
+    void violation(const char *what, unsigned long address);
+
+    byte *memory;
+    int fd;
+    FlashTiming timing;
+    unsigned long erase_until;  // host_micros when the erase in flight ends
+    unsigned long program_until;  // and the page program
+    unsigned long suspended_left;  // the rest of a suspended erase
+    bool suspended;
+    unsigned long erase_address;  // the sector or block being erased, while busy or suspended
+    unsigned long erase_len;
+    unsigned long program_address;  // the page program in flight, while busy
+    unsigned int program_len;
+    byte program_before[FLASH_PAGE_BYTES];  // what it is programming over, for power_cut()
+};
+
+#endif
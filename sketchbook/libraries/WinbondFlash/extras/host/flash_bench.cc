@@ -0,0 +1,364 @@
+/*
+Benchmark and regression test the flash library against a simulated chip.
+
+Build with:
+  g++ -O2 -std=c++11 -DFLASH_LATENCY_STATS=1 -I. -I../../src -o flash_bench flash_bench.cc FileFlash.cpp ../../src/FlashBase.cpp ../../src/SessionDirectory.cpp \
+    ../../src/CommitMarker.cpp
+
+Usage:
+  flash_bench [-m megabytes] [-r record_bytes] [-p period_us] [-w] [image.bin]
+
+Checks that FileFlash behaves like NOR flash, that stale write hints are
+ignored, that the read cache doesn't outlive an erase and that a lost commit
+marker doesn't commit what came after it, then logs records through the
+ring log with erase ahead, as gears_logger does, cuts the power and recovers
+the write address, and erases the whole chip and then just the used part.
+Times are on the simulated clock, with typical datasheet timings or, with
+-w, the worst case. Exits non-zero if anything fails.
+*/
+
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "FileFlash.h"
+#include "SessionDirectory.h"
+#include "CommitMarker.h"
+
+const unsigned long BENCH_ERASE_AHEAD_SECTORS = 2;
+const unsigned long BENCH_USED_BYTES = 40960;  // logged before erasing only what was used
+const unsigned long BENCH_QUEUE_RECORDS = 8;  // the logger's record queue, both halves
+const unsigned long BENCH_LEAD_IN = 1000000;  // microseconds from power up to logging, the logger's short press
+const unsigned int BENCH_COMMIT_SEARCH_BYTES = 393;  // how far back gears_logger looks for its last commit marker
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok)
+    failures++;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: flash_bench [-m megabytes] [-r record_bytes] [-p period_us] [-w] [image.bin]\n");
+  exit(1);
+}
+
+static void wait_idle(FileFlash *flash) {
+  /* Let anything the chip is doing finish
+  */
+  while (flash->busy());
+}
+
+static void test_nor_semantics(const char *path, const FlashTiming &timing) {
+  /* The simulator has to be as strict as the chip, or the benchmarks mean
+    nothing
+  */
+  unlink(path);
+  FileFlash flash(path, 4 * FLASH_BLOCK_BYTES, timing);
+  check(flash.is_open(), "image opens");
+  byte data[FLASH_PAGE_BYTES];
+  flash.read_raw(0, data, sizeof(data), READ_NORMAL);
+  bool erased = true;
+  for (unsigned int ctr = 0; ctr < sizeof(data); ctr++)
+    erased &= 0xff == data[ctr];
+  check(erased, "a new image reads erased");
+
+  byte pattern[] = {0xf0, 0x0f, 0x55};
+  flash.program_page(100, pattern, sizeof(pattern));
+  check(flash.busy(), "busy after a page program");
+  flash.read_raw(100, data, 1, READ_NORMAL);
+  check(1 == flash.stats.violations, "reading while busy is a violation");
+  wait_idle(&flash);
+  flash.reset_stats();
+  byte clear_more[] = {0x30, 0x0f, 0x55};
+  flash.program_page(100, clear_more, sizeof(clear_more));
+  wait_idle(&flash);
+  flash.read_raw(100, data, 3, READ_FAST);
+  check((0x30 == data[0]) && (0 == flash.stats.violations), "programming can clear more bits");
+  byte set_bits[] = {0xff};
+  flash.program_page(100, set_bits, sizeof(set_bits));
+  wait_idle(&flash);
+  flash.read_raw(100, data, 1, READ_NORMAL);
+  check((0x30 == data[0]) && (1 == flash.stats.violations), "programming can't set bits");
+
+  flash.reset_stats();
+  byte wrap[] = {0x01, 0x02, 0x03, 0x04};
+  flash.program_page(FLASH_PAGE_BYTES * 3 - 2, wrap, sizeof(wrap));
+  wait_idle(&flash);
+  flash.read_raw(FLASH_PAGE_BYTES * 2, data, 2, READ_NORMAL);
+  check((0x03 == data[0]) && (0x04 == data[1]) && (1 == flash.stats.violations),
+    "a program past the page end wraps to its start");
+
+  flash.reset_stats();
+  unsigned long start = host_micros;
+  flash.start_erase(0, FLASH_SECTOR_BYTES);
+  flash.erase_suspend();
+  flash.program_page(FLASH_SECTOR_BYTES, pattern, sizeof(pattern));
+  wait_idle(&flash);
+  flash.read_raw(FLASH_SECTOR_BYTES, data, 1, READ_NORMAL);
+  flash.read_raw(0, data + 1, 1, READ_NORMAL);
+  check((0xf0 == data[0]) && (1 == flash.stats.violations), "only the erase's own sector is off limits while suspended");
+  flash.erase_resume();
+  wait_idle(&flash);
+  flash.read_raw(100, data, 1, READ_NORMAL);
+  check((0xff == data[0]) && (host_micros - start >= timing.sector_erase), "a sector erase sets 0xff and takes its time");
+  check(1 == flash.stats.violations, "no other violations");
+}
+
+static void log_records(FileFlash *flash, unsigned long records, unsigned int record_bytes, unsigned long period) {
+  /* Append records at a fixed rate, polling in between like the logger's
+    main loop, after the time it takes to press the button. Like the logger,
+    records wait in a queue while write_ready() says the erase ahead hasn't
+    caught up. The stall is how long writing held up the loop.
+  */
+  byte record[256];
+  unsigned long busy_total = 0;
+  unsigned long worst_stall = 0;
+  unsigned long queued = 0;
+  unsigned long most_queued = 0;
+  unsigned long overflows = 0;
+  unsigned long written = 0;
+  unsigned long start = host_micros + BENCH_LEAD_IN;
+  while (host_micros < start) {
+    flash->poll();
+    host_micros += 50;
+  }
+  flash->reset_stats();
+  for (unsigned long ctr = 0; ctr < records; ctr++) {
+    unsigned long next_sample = host_micros + period;
+    if (BENCH_QUEUE_RECORDS == queued)
+      overflows++;
+    else
+      queued++;
+    if (queued > most_queued)
+      most_queued = queued;
+    unsigned long write_start = host_micros;
+    while ((0 != queued) && flash->write_ready(record_bytes)) {
+      for (unsigned int byte_ctr = 0; byte_ctr < record_bytes; byte_ctr++)
+        record[byte_ctr] = written + byte_ctr;
+      flash->write_data(record, record_bytes);
+      written++;
+      queued--;
+    }
+    unsigned long stall = host_micros - write_start;
+    busy_total += stall;
+    if (stall > worst_stall)
+      worst_stall = stall;
+    while (host_micros < next_sample) {
+      flash->poll();
+      host_micros += 50;  // the rest of the loop
+    }
+  }
+  printf("logged %lu records of %u bytes every %luus: %.1fs, %lu programs, %lu erases, %lu suspends\n",
+    records, record_bytes, period, (host_micros - start) / 1e6, flash->stats.programs, flash->stats.erases,
+    flash->stats.suspends);
+  printf("write_data: mean %.1fus, worst stall %luus, %lu records queued at most, %lu overflowed\n",
+    (double)busy_total / records, worst_stall, most_queued, overflows);
+  check(0 == overflows, "the record queue never overflowed");
+  check(0 == flash->stats.violations, "logging kept to NOR rules");
+}
+
+static FileFlash *power_up(const char *path, unsigned long len, const FlashTiming &timing, SessionDirectory **directory) {
+  /* Open the image and find the write address, as the logger does at boot
+  */
+  FileFlash *flash = new FileFlash(path, len, timing);
+  *directory = new SessionDirectory(flash);
+  (*directory)->debug_string = flash->debug_string;
+  unsigned long start = host_micros;
+  (*directory)->init();
+  flash->set_erase_ahead(BENCH_ERASE_AHEAD_SECTORS);
+  flash->init();
+  printf("power up: %lu reads, %luus\n", flash->stats.reads, host_micros - start);
+  return flash;
+}
+
+static void power_down(FileFlash *flash, SessionDirectory *directory) {
+  /* Cut the power, losing anything still staged
+  */
+  flash->power_cut();
+  delete directory;
+  delete flash;
+}
+
+static void test_write_hints(const char *path, const FlashTiming &timing) {
+  /* A write hint is only a shortcut: one in the reserved space or past the
+    end of the chip, as a stale EEPROM can hand back, is ignored without
+    reading anything outside the data
+  */
+  unlink(path);
+  SessionDirectory *directory;
+  FileFlash *flash = power_up(path, 4 * FLASH_BLOCK_BYTES, timing, &directory);
+  byte record[100];
+  memset(record, 0x5a, sizeof(record));
+  for (unsigned int ctr = 0; ctr < 50; ctr++)
+    flash->write_data(record, sizeof(record));
+  flash->flush();
+  unsigned long expected = flash->get_write_address();
+  unsigned int hints[] = {0, (unsigned int)(flash->data_start / FLASH_SECTOR_BYTES) - 1, flash->get_write_sector(),
+    (unsigned int)(flash->len_bytes / FLASH_SECTOR_BYTES), 0xfff0};
+  for (unsigned int ctr = 0; ctr < sizeof(hints) / sizeof(hints[0]); ctr++) {
+    flash->reset_stats();
+    flash->set_write_hint(hints[ctr]);
+    unsigned long found = flash->find_next_write_address();
+    sprintf(flash->debug_string, "write hint %u finds the write address without reading outside the data", hints[ctr]);
+    check((expected == found) && (0 == flash->stats.violations), flash->debug_string);
+  }
+  delete directory;
+  delete flash;
+}
+
+static void test_erase_cache(const char *path, const FlashTiming &timing) {
+  /* A small read from a sector while it is being erased gets cached half
+    erased, and that line must not outlive the erase
+  */
+  unlink(path);
+  FileFlash flash(path, 4 * FLASH_BLOCK_BYTES, timing);
+  unsigned long sector = FLASH_SECTOR_BYTES;
+  byte data[FLASH_PAGE_BYTES];
+  memset(data, 0x00, sizeof(data));
+  flash.program_data(sector, data, sizeof(data));
+  flash.begin_erase(sector, sector + FLASH_SECTOR_BYTES);
+  while (!flash.erasing())
+    flash.poll();
+  flash.read_data(sector, data, 4);  // suspends the erase, so it is read mid-erase
+  while (!flash.is_done())
+    flash.poll();
+  flash.read_data(sector, data, 4);
+  bool erased = true;
+  for (unsigned int ctr = 0; ctr < 4; ctr++)
+    erased &= 0xff == data[ctr];
+  check(erased, "a sector cached mid-erase reads erased once the erase is done");
+}
+
+static void test_commit_search(const char *path, const FlashTiming &timing) {
+  /* With no valid commit marker as far back as the search goes, nothing
+    after the first block is committed, however long the data is
+  */
+  unlink(path);
+  FileFlash flash(path, 4 * FLASH_BLOCK_BYTES, timing);
+  unsigned long first_block = flash.get_write_address();
+  byte data[100];
+  memset(data, 0x42, sizeof(data));
+  byte marker[COMMIT_MARKER_BYTES];
+  make_commit_marker(marker, 7, 0);
+  flash.write_data(data, sizeof(data));
+  flash.write_data(marker, sizeof(marker));
+  flash.flush();
+  unsigned long committed = flash.get_write_address();
+  unsigned long records = 0;
+  unsigned long found = find_commit_marker(&flash, first_block, flash.get_write_address(), BENCH_COMMIT_SEARCH_BYTES,
+    &records);
+  check((committed == found) && (7 == records), "a marker at the end commits everything before it");
+  marker[COMMIT_MARKER_BYTES - 1] ^= 0x01;
+  for (unsigned int ctr = 0; ctr < 2 * BENCH_COMMIT_SEARCH_BYTES; ctr += sizeof(data)) {
+    flash.write_data(data, sizeof(data));
+    if (0 == ctr)
+      flash.write_data(marker, sizeof(marker));  // torn, so it doesn't count
+  }
+  flash.flush();
+  unsigned long end = flash.get_write_address();
+  found = find_commit_marker(&flash, first_block, end, BENCH_COMMIT_SEARCH_BYTES, &records);
+  check((first_block == found) && (0 == records),
+    "with no marker within the search, nothing is committed, rather than everything");
+  found = find_commit_marker(&flash, first_block, end, end - first_block, &records);
+  check((committed == found) && (7 == records), "searching further finds the last whole marker");
+  check(0 == flash.stats.violations, "the search kept to NOR rules");
+}
+
+static void bench_logging(const char *path, unsigned long len, unsigned int record_bytes, unsigned long period,
+    const FlashTiming &timing) {
+  /* Log past the end of the chip through the ring log with erase ahead,
+    then cut the power during a page program, and again during an erase,
+    checking the write address is found each time. Then erase the chip,
+    log a little and erase only that.
+  */
+  unlink(path);
+  SessionDirectory *directory;
+  FileFlash *flash = power_up(path, len, timing, &directory);
+  flash->reset_latency();
+  log_records(flash, (2 * len) / record_bytes, record_bytes, period);
+  flash->print_latency();
+  flash->flush();
+  while (flash->erasing())
+    flash->poll();
+  unsigned long programmed = flash->get_write_address();
+  byte tail[FLASH_PAGE_BYTES];
+  memset(tail, 0x42, sizeof(tail));
+  flash->write_data(tail, FLASH_PAGE_BYTES - programmed % FLASH_PAGE_BYTES);
+  power_down(flash, directory);
+  flash = power_up(path, len, timing, &directory);
+  unsigned long end = flash->get_write_address();
+  check((end > programmed) && (end <= programmed + FLASH_PAGE_BYTES), "power cut during a page program");
+
+  log_records(flash, FLASH_SECTOR_BYTES / record_bytes, record_bytes, period);
+  byte record[256];
+  memset(record, 0x24, sizeof(record));
+  for (unsigned long ctr = 0; (ctr < len / record_bytes) && !flash->erasing(); ctr++) {
+    flash->write_data(record, record_bytes);
+    flash->poll();
+  }
+  check(flash->erasing(), "an erase ahead started");
+  programmed = flash->get_write_address();
+  flash->flush();
+  power_down(flash, directory);
+  flash = power_up(path, len, timing, &directory);
+  end = flash->get_write_address();
+  check((end > programmed - programmed % FLASH_PAGE_BYTES) && (end <= programmed), "power cut during an erase");
+
+  flash->reset_stats();
+  unsigned long start = host_micros;
+  while (!flash->begin_erase(0, len))
+    flash->poll();
+  while (!flash->is_done()) {
+    flash->poll();
+    host_micros += 50;
+  }
+  printf("erasing the chip: %.1fs, %lu erases\n", (host_micros - start) / 1e6, flash->stats.erases);
+
+  flash->set_write_address(flash->data_start);
+  log_records(flash, BENCH_USED_BYTES / record_bytes, record_bytes, period);
+  unsigned long used_end = flash->get_write_address();
+  flash->reset_stats();
+  start = host_micros;
+  while (!flash->begin_erase_used())
+    flash->poll();
+  while (!flash->is_done()) {
+    flash->poll();
+    host_micros += 50;
+  }
+  printf("erasing %lukB used: %.2fs, %lu erases\n", used_end >> 10, (host_micros - start) / 1e6, flash->stats.erases);
+  flash->set_write_address(flash->data_start);
+  check(flash->data_start == flash->find_next_write_address(), "erasing the used space leaves nothing behind");
+  flash->set_erase_ahead(0);  // so the benchmark can use the erased sector after the write address
+  flash->benchmark();
+  check(0 == flash->stats.violations, "erasing kept to NOR rules");
+  delete directory;
+  delete flash;
+}
+
+int main(int argc, char **argv) {
+  unsigned long megabytes = 8;
+  unsigned int record_bytes = 6;
+  unsigned long period = 1000;
+  FlashTiming timing = FLASH_TIMING_TYPICAL;
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "m:r:p:w"))) {
+    switch (opt) {
+      case 'm': megabytes = atol(optarg); break;
+      case 'r': record_bytes = atoi(optarg); break;
+      case 'p': period = atol(optarg); break;
+      case 'w': timing = FLASH_TIMING_WORST; break;
+      default: usage();
+    }
+  }
+  if ((argc - optind > 1) || (0 == megabytes) || (0 == record_bytes) || (record_bytes > 256))
+    usage();
+  const char *path = (argc > optind) ? argv[optind] : "flash_bench.bin";
+  test_nor_semantics(path, timing);
+  test_write_hints(path, timing);
+  test_erase_cache(path, timing);
+  test_commit_search(path, timing);
+  bench_logging(path, megabytes << 20, record_bytes, period, timing);
+  printf("%s\n", failures ? "FAILED" : "passed");
+  return failures ? 1 : 0;
+}
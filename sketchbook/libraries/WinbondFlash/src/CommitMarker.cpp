@@ -0,0 +1,62 @@
+#include "Arduino.h"
+#include "CommitMarker.h"
+
+static byte commit_check(byte *data, byte len) {
+  /* The XOR of the given bytes
+  */
+  byte check = 0;
+  for (byte ctr = 0; ctr < len; ctr++)
+    check ^= data[ctr];
+  return check;
+}
+
+void make_commit_marker(byte *marker, unsigned long records, unsigned int torn_bytes) {
+  /* Fill in the COMMIT_MARKER_BYTES of a marker
+  */
+  marker[0] = COMMIT_MARKER;
+  marker[1] = COMMIT_MAGIC;
+  for (byte ctr = 0; ctr < 4; ctr++)
+    marker[2 + ctr] = records >> (8 * ctr);
+  marker[6] = torn_bytes & 0xff;
+  marker[7] = torn_bytes >> 8;
+  marker[8] = commit_check(marker, COMMIT_MARKER_BYTES - 1);
+}
+
+byte check_commit_marker(byte *data, byte len, unsigned long *records) {
+  /* How long the commit marker at the start of data is, setting the records
+    it committed, or zero if there isn't a whole valid one there
+  */
+  if ((COMMIT_MARKER_BYTES > len) || (COMMIT_MARKER != data[0]) || (COMMIT_MAGIC != data[1]) ||
+      (data[COMMIT_MARKER_BYTES - 1] != commit_check(data, COMMIT_MARKER_BYTES - 1)))
+    return 0;
+  *records = 0;
+  for (byte ctr = 0; ctr < 4; ctr++)
+    *records |= (unsigned long)data[2 + ctr] << (8 * ctr);
+  return COMMIT_MARKER_BYTES;
+}
+
+unsigned long find_commit_marker(FlashBase *flash, unsigned long first_block, unsigned long end,
+    unsigned int search_bytes, unsigned long *records) {
+  /* Look back from the end of the data for the last commit marker, returning
+    the address just after it and the records committed by it. The writer
+    puts one at least every search_bytes, so only that far back is read, a
+    cache line at a time. If there isn't one there, it was lost or torn, and
+    nothing after first_block can be taken as committed, so that is
+    returned, with no records. Everything after the address returned still
+    has to be checked.
+  */
+  unsigned long search = flash->ring_distance(first_block, end);
+  if (search > search_bytes)
+    search = search_bytes;
+  byte marker[COMMIT_MARKER_BYTES];
+  for (unsigned int back = COMMIT_MARKER_BYTES; back <= search; back++) {
+    unsigned long address = flash->ring_address(end, -(long)back);
+    if (COMMIT_MARKER != flash->read_byte(address))
+      continue;
+    flash->read_ring(address, marker, COMMIT_MARKER_BYTES);
+    if (0 != check_commit_marker(marker, COMMIT_MARKER_BYTES, records))
+      return flash->ring_address(address, COMMIT_MARKER_BYTES);
+  }
+  *records = 0;
+  return first_block;
+}
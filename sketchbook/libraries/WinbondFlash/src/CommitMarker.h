@@ -0,0 +1,26 @@
+/*
+Commit markers in a ring log. A marker written after some data, and
+programmed straight away, means everything before it is whole, so after a
+power cut only the data after the last marker needs checking.
+*/
+
+#ifndef COMMIT_MARKER_H
+#define COMMIT_MARKER_H
+
+#include "Arduino.h"
+#include "FlashBase.h"
+
+#define COMMIT_MARKER 0xc3
+#define COMMIT_MAGIC 0x5e
+#define COMMIT_MARKER_BYTES 9  // marker, magic, records committed, torn bytes skipped, check byte
+
+/* A marker is COMMIT_MARKER, COMMIT_MAGIC, the records committed so far as
+  four bytes, the bytes skipped before the marker as two, all low byte first,
+  then an XOR check byte.
+*/
+void make_commit_marker(byte *marker, unsigned long records, unsigned int torn_bytes);
+byte check_commit_marker(byte *data, byte len, unsigned long *records);
+unsigned long find_commit_marker(FlashBase *flash, unsigned long first_block, unsigned long end,
+  unsigned int search_bytes, unsigned long *records);
+
+#endif
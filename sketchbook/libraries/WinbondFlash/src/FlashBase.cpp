@@ -1,135 +1,760 @@
-#include "Arduino.h"
-#include "FlashBase.h"
-
-#define DEBUG_LOGGING
-
-void print_data_array_256(byte *data_array) {
-  /* Print the contents of a data array that is 256 bytes long
-  */
-  for (byte row = 0; row < 32; row++) {
-    byte start_addr = row << 3;
-    Serial.print(start_addr);
-    Serial.print(":_");
-    for (byte col = 0; col < 8; col++) {
-      Serial.print(data_array[start_addr + col]);
-      Serial.print("_");
-    }
-    Serial.println("");
-  }
-}
-
-FlashBase::FlashBase() {
-    len_bytes = 0;
-    write_address = 0;
-}
-
-void FlashBase::test_flash(void) {
-  /* Test reading, writing and navigating in flash
-  */
-  unsigned long func_enter = millis();
-  sprintf(debug_string, "test_flash_enter(%lu)", func_enter);
-  Serial.println(debug_string);
-  init();
-
-  // byte-wise writing
-  write_byte(0xde);
-  write_byte(0xad);
-  write_byte(0xbe);
-  write_byte(0xef);
-  
-  sprintf(debug_string, "write_address_now(%lu)", write_address);
-  Serial.println(debug_string);
-
-  // block writing
-  byte data_array[256];
-  for (unsigned int ctr = 0; ctr < 256; ctr++)
-    data_array[ctr] = ctr;
-  write_data(data_array, 256);
-  
-  sprintf(debug_string, "write_address_now(%lu)", write_address);
-  Serial.println(debug_string);
-
-  // byte-wise reading
-  Serial.println("byte-wise reading ----");
-  for (unsigned int ctr=0; ctr<256; ctr++)
-    data_array[ctr] = read_byte(ctr);
-  print_data_array_256(data_array);
-
-  // block reading
-  Serial.println("block reading ----");
-  read_data(3, data_array, 256);
-  print_data_array_256(data_array);
-  
-  unsigned long func_exit = millis();
-  sprintf(debug_string, "test_flash_exit(%lu, %lu)", func_exit, func_exit - func_enter);
-  Serial.println(debug_string);
-}
-
-void FlashBase::init(void) {
-  /* Set up the flash chip and find the next free location to write
-  */
-  set_write_address(find_next_write_address());
-}
-
-unsigned long FlashBase::find_next_write_address(void) {
-  /* Scan through the flash chip and find the next location to write
-  */
-  unsigned long next_write_address = 0;
-  for (; next_write_address <= len_bytes; next_write_address += 256) {
-    if (0xff == read_byte(next_write_address))
-      break;
-  }
-  if (0 != next_write_address) {
-    while (0xff == read_byte(next_write_address))
-      next_write_address--;
-  }
-  #ifdef DEBUG_LOGGING
-  Serial.print("find_next_write_address: ");
-  Serial.println(next_write_address);
-  #endif
-  return next_write_address;
-}
-
-void FlashBase::set_write_address(unsigned long address) {
-  /* Set the write address - NB NB NB - writes WILL fail if trying to write to
-    memory that has not been erased.
-  */
-  write_address = address;
-}
-
-byte FlashBase::read_byte(unsigned long address) {
-  /* Read a byte from the given address
-  */
-  byte rv;
-  read_data(address, &rv, 1);
-  return rv;
-}
-
-void FlashBase::write_enable(void) {
-  /* Set the write-enable latch
-  */
-  // pass
-}
-
-void FlashBase::write_byte(byte data) {
-  /* Write a byte to the current address
-  */
-  write_enable();
-  write_data(&data, 1);
-}
-
-void FlashBase::chip_query(void) {
-  /* Query the flash chip and print information about it to the serial line
-  */
-  byte flash_info[] = {0, 0, 0, 0, 0, 0};
-  read_flash_info(flash_info);
-  sprintf(debug_string, "flash_info: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x",
-    flash_info[0], flash_info[1], flash_info[2], flash_info[3], flash_info[4], flash_info[5]);
-  Serial.println(debug_string);
-}
-
-void FlashBase::wait_busy(void) {
-  /* Spin while the SPI busy line is high
-  */
-  while(busy());
-}
+#include "Arduino.h"
+#include "FlashBase.h"
+
+#define DEBUG_LOGGING
+
+void print_data_array_256(byte *data_array) {
+  /* Print the contents of a data array that is 256 bytes long
+  */
+  for (byte row = 0; row < 32; row++) {
+    byte start_addr = row << 3;
+    Serial.print(start_addr);
+    Serial.print(F(":_"));
+    for (byte col = 0; col < 8; col++) {
+      Serial.print(data_array[start_addr + col]);
+      Serial.print(F("_"));
+    }
+    Serial.println(F(""));
+  }
+}
+
+FlashBase::FlashBase() {
+    len_bytes = 0;
+    data_start = 0;
+    write_address = 0;
+    write_buffer_len = 0;
+    write_hint = FLASH_NO_WRITE_HINT;
+    erase_state = ERASE_IDLE;
+    erase_address = 0;
+    erase_end = 0;
+    erase_bytes = 0;
+    resume_time = 0;
+    erase_start_time = 0;
+    erase_ahead_sectors = 0;
+    erased_until = 0;
+    erasing_ahead = false;
+    cache_last = 0;
+    read_mode = READ_AUTO;
+    invalidate_cache();
+    reset_latency();
+}
+
+void FlashBase::test_flash(void) {
+  /* Test reading, writing and navigating in flash
+  */
+  unsigned long func_enter = millis();
+  sprintf_P(debug_string, PSTR("test_flash_enter(%lu)"), func_enter);
+  Serial.println(debug_string);
+  init();
+
+  // byte-wise writing
+  write_byte(0xde);
+  write_byte(0xad);
+  write_byte(0xbe);
+  write_byte(0xef);
+  
+  sprintf_P(debug_string, PSTR("write_address_now(%lu)"), write_address);
+  Serial.println(debug_string);
+
+  // block writing
+  byte data_array[256];
+  for (unsigned int ctr = 0; ctr < 256; ctr++)
+    data_array[ctr] = ctr;
+  write_data(data_array, 256);
+  flush();
+  
+  sprintf_P(debug_string, PSTR("write_address_now(%lu)"), write_address);
+  Serial.println(debug_string);
+
+  // byte-wise reading
+  Serial.println(F("byte-wise reading ----"));
+  for (unsigned int ctr=0; ctr<256; ctr++)
+    data_array[ctr] = read_byte(ctr);
+  print_data_array_256(data_array);
+
+  // block reading
+  Serial.println(F("block reading ----"));
+  read_data(3, data_array, 256);
+  print_data_array_256(data_array);
+  
+  unsigned long func_exit = millis();
+  sprintf_P(debug_string, PSTR("test_flash_exit(%lu, %lu)"), func_exit, func_exit - func_enter);
+  Serial.println(debug_string);
+}
+
+void FlashBase::benchmark(void) {
+  /* Time erasing, programming and reading a sector and print the throughput.
+    The sector after the write address is used, and erased again at the end,
+    so it must not hold anything - in a ring log it has to be erased ahead.
+  */
+  while (ERASE_IDLE != erase_state)
+    poll();
+  flush();  // the write buffer is used as the data below
+  unsigned long sector = write_address - (write_address % FLASH_SECTOR_BYTES) + FLASH_SECTOR_BYTES;
+  if (len_bytes <= sector)
+    sector = (0 != erase_ahead_sectors) ? data_start : len_bytes;
+  bool scratch_free = (0 == erase_ahead_sectors) ? (sector < len_bytes) : in_erased_gap(sector + FLASH_SECTOR_BYTES - 1);
+  if (!scratch_free) {
+    Serial.println(F("benchmark: no free sector after the write address"));
+    return;
+  }
+  for (unsigned int ctr = 0; ctr < FLASH_PAGE_BYTES; ctr++)
+    write_buffer[ctr] = ctr;
+  unsigned long times[3];  // erase, program, read
+  unsigned long start = micros();
+  begin_erase(sector, sector + FLASH_SECTOR_BYTES);
+  while (!is_done())
+    poll();
+  times[0] = micros() - start;
+  start = micros();
+  for (unsigned long address = sector; address < sector + FLASH_SECTOR_BYTES; address += FLASH_PAGE_BYTES)
+    program_data(address, write_buffer, FLASH_PAGE_BYTES);
+  wait_busy();
+  times[1] = micros() - start;
+  start = micros();
+  for (unsigned long address = sector; address < sector + FLASH_SECTOR_BYTES; address += FLASH_PAGE_BYTES)
+    read_data(address, write_buffer, FLASH_PAGE_BYTES);
+  times[2] = micros() - start;
+  begin_erase(sector, sector + FLASH_SECTOR_BYTES);
+  while (!is_done())
+    poll();
+  // bytes per millisecond is kB/s
+  sprintf_P(debug_string, PSTR("benchmark(%lu): erase(%lu kB/s) program(%lu kB/s) read(%lu kB/s)"), sector,
+    FLASH_SECTOR_BYTES * 1000UL / (times[0] + 1), FLASH_SECTOR_BYTES * 1000UL / (times[1] + 1),
+    FLASH_SECTOR_BYTES * 1000UL / (times[2] + 1));
+  Serial.println(debug_string);
+}
+
+void FlashBase::init(void) {
+  /* Set up the flash chip and find the next free location to write
+  */
+  if ((0 != erase_ahead_sectors) && (len_bytes - data_start < (erase_ahead_sectors + 2UL) * FLASH_SECTOR_BYTES)) {
+    Serial.println(F("flash too small to erase ahead"));
+    erase_ahead_sectors = 0;
+  }
+  set_write_address(find_next_write_address());
+  // get the erase ahead going now, rather than leaving it to hold up the first write
+  poll();
+  if (ERASE_WAITING == erase_state)
+    poll();
+}
+
+unsigned long FlashBase::find_next_write_address(void) {
+  /* Find the next location to write. Data is only ever appended, so the used
+    pages are followed by blank ones and the boundary can be binary searched.
+    If the write hint is good, only the two sectors it points at are searched.
+    A ring log that has wrapped needs a slower search for its erased gap.
+  */
+  flush();  // the write buffer is used as scratch space below
+  unsigned long num_pages = len_bytes / FLASH_PAGE_BYTES;
+  unsigned long first_page = data_start / FLASH_PAGE_BYTES;
+  unsigned long end_page = num_pages;
+  if (FLASH_NO_WRITE_HINT != write_hint) {
+    unsigned long hint_first = (unsigned long)write_hint * (FLASH_SECTOR_BYTES / FLASH_PAGE_BYTES);
+    unsigned long hint_end = hint_first + 2 * (FLASH_SECTOR_BYTES / FLASH_PAGE_BYTES);
+    if (hint_end > num_pages)
+      hint_end = num_pages;
+    // a stale hint can be anywhere, so only look around it if it is inside the data
+    if ((first_page <= hint_first) && (hint_first < num_pages)) {
+      bool used_before = (first_page == hint_first) || !page_is_blank(hint_first - 1);
+      bool blank_after = (num_pages == hint_end) || page_is_blank(hint_end);
+      if (used_before && blank_after) {
+        first_page = hint_first;
+        end_page = hint_end;
+      }
+    }
+  }
+  unsigned long next_write_address;
+  if ((0 != erase_ahead_sectors) && (data_start / FLASH_PAGE_BYTES == first_page) &&
+      !page_is_blank(first_page) && !page_is_blank(num_pages - 1))
+    next_write_address = search_ring_write_address();
+  else
+    next_write_address = search_write_address(first_page, end_page);
+  if (len_bytes <= next_write_address)
+    next_write_address = (0 != erase_ahead_sectors) ? data_start : len_bytes;
+  #ifdef DEBUG_LOGGING
+  Serial.print(F("find_next_write_address: "));
+  Serial.println(next_write_address);
+  #endif
+  return next_write_address;
+}
+
+unsigned long FlashBase::search_write_address(unsigned long first_page, unsigned long end_page) {
+  /* Binary search for the first blank page in the given range, then find the
+    last used byte in the page before it.
+  */
+  while (first_page < end_page) {
+    unsigned long mid_page = first_page + (end_page - first_page) / 2;
+    if (page_is_blank(mid_page))
+      end_page = mid_page;
+    else
+      first_page = mid_page + 1;
+  }
+  if (data_start / FLASH_PAGE_BYTES == first_page)
+    return data_start;
+  unsigned long page_address = (first_page - 1) * FLASH_PAGE_BYTES;
+  read_data(page_address, write_buffer, FLASH_PAGE_BYTES);
+  unsigned int used = FLASH_PAGE_BYTES;
+  while ((used > 0) && (0xff == write_buffer[used - 1]))
+    used--;
+  return page_address + used;
+}
+
+unsigned long FlashBase::search_ring_write_address(void) {
+  /* Find the write address in a ring log that has wrapped around. The data
+    is not in address order any more, so look sector by sector for the start
+    of the erased gap, then binary search the sector before it.
+  */
+  unsigned long pages_per_sector = FLASH_SECTOR_BYTES / FLASH_PAGE_BYTES;
+  unsigned long first_sector = data_start / FLASH_SECTOR_BYTES;
+  unsigned long num_sectors = len_bytes / FLASH_SECTOR_BYTES;
+  bool last_blank = page_is_blank((num_sectors - 1) * pages_per_sector);
+  for (unsigned long sector = first_sector; sector < num_sectors; sector++) {
+    bool blank = page_is_blank(sector * pages_per_sector);
+    if (blank && !last_blank) {
+      unsigned long used_sector = (first_sector == sector) ? num_sectors - 1 : sector - 1;
+      return search_write_address(used_sector * pages_per_sector, (used_sector + 1) * pages_per_sector);
+    }
+    last_blank = blank;
+  }
+  // no gap at all, so the best we can do is carry on from the start
+  return data_start;
+}
+
+bool FlashBase::page_is_blank(unsigned long page) {
+  /* Is every byte in the given page still erased?
+  */
+  read_data(page * FLASH_PAGE_BYTES, write_buffer, FLASH_PAGE_BYTES);
+  for (unsigned int ctr = 0; ctr < FLASH_PAGE_BYTES; ctr++) {
+    if (0xff != write_buffer[ctr])
+      return false;
+  }
+  return true;
+}
+
+void FlashBase::set_write_address(unsigned long address) {
+  /* Set the write address - NB NB NB - writes WILL fail if trying to write to
+    memory that has not been erased. Anything still staged is flushed first.
+  */
+  flush();
+  write_address = address;
+  // the rest of this sector has not been written yet, so it is still erased
+  erased_until = address - (address % FLASH_SECTOR_BYTES) + FLASH_SECTOR_BYTES;
+  if (len_bytes <= erased_until)
+    erased_until = data_start;
+}
+
+unsigned long FlashBase::get_write_address(void) {
+  /* The address the next byte will be written to, including staged data
+  */
+  return write_address;
+}
+
+void FlashBase::set_write_hint(unsigned int sector) {
+  /* Tell init() which sector the write address was last seen in, usually
+    restored from somewhere persistent like EEPROM
+  */
+  write_hint = sector;
+}
+
+unsigned int FlashBase::get_write_sector(void) {
+  /* The sector the write address is currently in, to be saved as a write hint
+  */
+  return write_address / FLASH_SECTOR_BYTES;
+}
+
+void FlashBase::write_data(byte *data, unsigned int length_to_write) {
+  /* Stage data for writing at the current address. Whole pages are programmed
+    as soon as they fill up, so a write never wraps around inside a page.
+  */
+  unsigned long start = micros();
+  while (length_to_write > 0) {
+    if ((len_bytes <= write_address) && (0 != erase_ahead_sectors)) {
+      // a ring log, so carry on from the start - the buffer was flushed at the page boundary
+      write_address = data_start;
+    }
+    if (len_bytes <= write_address) {
+      #ifdef DEBUG_LOGGING
+      sprintf_P(debug_string, PSTR("cannot write to address %lu, larger than flash size %lu"), write_address, len_bytes);
+      Serial.println(debug_string);
+      #endif
+      break;
+    }
+    if ((0 != erase_ahead_sectors) && (0 == write_address % FLASH_SECTOR_BYTES))
+      wait_erased_ahead();
+    unsigned int page_space = FLASH_PAGE_BYTES - (write_address % FLASH_PAGE_BYTES);
+    unsigned int chunk = (length_to_write < page_space) ? length_to_write : page_space;
+    if (chunk > len_bytes - write_address)
+      chunk = len_bytes - write_address;
+    memcpy(write_buffer + write_buffer_len, data, chunk);
+    write_buffer_len += chunk;
+    write_address += chunk;
+    data += chunk;
+    length_to_write -= chunk;
+    if (0 == write_address % FLASH_PAGE_BYTES)
+      flush();
+  }
+  add_latency(LATENCY_WRITE, start);
+}
+
+bool FlashBase::write_ready(unsigned int length_to_write) {
+  /* Can this much be written without write_data() waiting for the erase
+    ahead? A logger can keep its data queued until it can, rather than
+    stall. Without erase ahead there is never anything to wait for.
+  */
+  if ((0 == erase_ahead_sectors) || (0 == length_to_write))
+    return true;
+  unsigned long offset = write_address % FLASH_SECTOR_BYTES;
+  unsigned long to_boundary = (0 == offset) ? 0 : FLASH_SECTOR_BYTES - offset;
+  if (length_to_write <= to_boundary)
+    return true;  // it stays inside the sector being written, which is already erased
+  // the last sector the data reaches into needs as much erased ahead of it as wait_erased_ahead() waits for
+  unsigned long last_boundary = to_boundary + (length_to_write - to_boundary - 1) / FLASH_SECTOR_BYTES * FLASH_SECTOR_BYTES;
+  return ring_distance(write_address, erased_until) >= last_boundary + erased_ahead_needed();
+}
+
+void FlashBase::flush(void) {
+  /* Program whatever is staged in the write buffer. The staged data never
+    crosses a page boundary, so this is always a single page program.
+  */
+  if (0 == write_buffer_len)
+    return;
+  make_ready();
+  invalidate_cache();
+  program_page(write_address - write_buffer_len, write_buffer, write_buffer_len);
+  #if FLASH_LATENCY_STATS
+  bytes_programmed += write_buffer_len;
+  #endif
+  write_buffer_len = 0;
+}
+
+void FlashBase::program_data(unsigned long address, byte *data, unsigned int length_to_write) {
+  /* Program data at the given address, outside of the appended data - for
+    things like directories that live in the reserved space. The memory
+    must already be erased.
+  */
+  while (length_to_write > 0) {
+    unsigned int page_space = FLASH_PAGE_BYTES - (address % FLASH_PAGE_BYTES);
+    unsigned int chunk = (length_to_write < page_space) ? length_to_write : page_space;
+    make_ready();
+    invalidate_cache();
+    program_page(address, data, chunk);
+    #if FLASH_LATENCY_STATS
+    bytes_programmed += chunk;
+    #endif
+    address += chunk;
+    data += chunk;
+    length_to_write -= chunk;
+  }
+}
+
+bool FlashBase::begin_erase(unsigned long start_address, unsigned long end_address) {
+  /* Start erasing the sectors covering the given address range. This returns
+    straight away - poll() must be called regularly until is_done(). Reads
+    and programs are allowed in the meantime, except to the sector or block
+    being erased.
+  */
+  if (ERASE_IDLE != erase_state)
+    return false;
+  flush();
+  start_erase_range(start_address, end_address);
+  return true;
+}
+
+bool FlashBase::begin_erase_used(void) {
+  /* Start erasing only what has been written - the reserved space, and the
+    data up to the write address. A ring log that has wrapped around has
+    data after the erased gap too, so all of it goes. Like begin_erase(),
+    this needs poll() until is_done(), and the write address set again after.
+  */
+  if (ERASE_IDLE != erase_state)
+    return false;
+  flush();
+  unsigned long end_address = write_address;
+  if ((0 != erase_ahead_sectors) && !page_is_blank(erased_until / FLASH_PAGE_BYTES))
+    end_address = len_bytes;
+  start_erase_range(0, end_address);
+  return true;
+}
+
+void FlashBase::set_erase_ahead(byte sectors) {
+  /* Keep this many sectors ahead of the write address erased in the
+    background, from poll(). This turns the data into a ring log: writing
+    carries on from data_start at the end of the chip, and the oldest data is
+    erased to make room.
+  */
+  erase_ahead_sectors = sectors;
+}
+
+bool FlashBase::in_erased_gap(unsigned long address) {
+  /* Is the given address in the erased space ahead of the write address, so
+    whatever used to be there is gone?
+  */
+  if (0 == erase_ahead_sectors)
+    return false;
+  return ring_distance(write_address, address) < ring_distance(write_address, erased_until);
+}
+
+unsigned long FlashBase::ring_distance(unsigned long from, unsigned long to) {
+  /* How many bytes it is from one address to the next, going forwards through
+    the data and wrapping back to data_start at the end of the chip
+  */
+  if (from <= to)
+    return to - from;
+  return (len_bytes - from) + (to - data_start);
+}
+
+unsigned long FlashBase::ring_address(unsigned long address, long offset) {
+  /* The address the given number of bytes on from another, wrapping around
+    the end of the chip to data_start. A negative offset goes backwards.
+  */
+  long ring_len = len_bytes - data_start;
+  offset %= ring_len;
+  if (offset < 0)
+    offset += ring_len;
+  return data_start + (address - data_start + offset) % ring_len;
+}
+
+void FlashBase::read_ring(unsigned long address, byte *return_array, unsigned int length_to_read) {
+  /* Read data that may run off the end of the chip and carry on at data_start
+  */
+  if (length_to_read > len_bytes - address) {
+    unsigned int to_end = len_bytes - address;
+    read_data(address, return_array, to_end);
+    address = data_start;
+    return_array += to_end;
+    length_to_read -= to_end;
+  }
+  read_data(address, return_array, length_to_read);
+}
+
+void FlashBase::start_erase_range(unsigned long start_address, unsigned long end_address) {
+  /* Set up the erase state machine for the given range - poll() does the work
+  */
+  erase_address = start_address - (start_address % FLASH_SECTOR_BYTES);
+  erase_end = end_address;
+  if (erase_end > len_bytes)
+    erase_end = len_bytes;
+  erasing_ahead = false;
+  if (erase_address < erase_end)
+    erase_state = ERASE_WAITING;
+}
+
+void FlashBase::wait_erased_ahead(void) {
+  /* Don't start writing a sector before the erase ahead has got to it, and
+    to the one after it too if there is more than one sector erased ahead.
+    The power going off mid-erase leaves that sector neither blank nor used,
+    so a whole blank sector always has to sit between it and the data for
+    search_ring_write_address() to find. This only blocks if the erasing has
+    fallen behind the writing - write_ready() says whether it would.
+  */
+  while (ring_distance(write_address, erased_until) < erased_ahead_needed())
+    poll();
+}
+
+unsigned long FlashBase::erased_ahead_needed(void) {
+  /* How much has to be erased from a sector boundary on before writing there
+  */
+  return (erase_ahead_sectors > 1) ? 2UL * FLASH_SECTOR_BYTES : FLASH_SECTOR_BYTES;
+}
+
+void FlashBase::poll(void) {
+  /* Move a started erase along - resume it if it was suspended, or start on
+    the next sector or block if the last one is done
+  */
+  switch (erase_state) {
+    case ERASE_IDLE:
+      if ((0 != erase_ahead_sectors) &&
+          (ring_distance(write_address, erased_until) < erase_ahead_sectors * (unsigned long)FLASH_SECTOR_BYTES)) {
+        start_erase_range(erased_until, erased_until + FLASH_SECTOR_BYTES);
+        erasing_ahead = true;
+      }
+      break;
+    case ERASE_SUSPENDED:
+      if (!busy()) {  // a page program may still be running
+        erase_resume();
+        resume_time = micros();
+        erase_state = ERASE_RUNNING;
+      }
+      break;
+    case ERASE_RUNNING:
+      if (busy())
+        break;
+      add_latency(LATENCY_ERASE, erase_start_time);
+      // a read while it was suspended may have cached the sector half erased
+      invalidate_cache_range(erase_address, erase_address + erase_bytes);
+      erase_address += erase_bytes;
+      erase_state = (erase_address < erase_end) ? ERASE_WAITING : ERASE_IDLE;
+      if ((ERASE_IDLE == erase_state) && erasing_ahead) {
+        erasing_ahead = false;
+        erased_until = (len_bytes <= erase_end) ? data_start : erase_end;
+      }
+      break;
+    case ERASE_WAITING:
+      if (busy())
+        break;
+      // use the biggest block erase that fits what is left to erase
+      erase_bytes = FLASH_SECTOR_BYTES;
+      if ((0 == erase_address % FLASH_BLOCK_BYTES) && (erase_end - erase_address >= FLASH_BLOCK_BYTES))
+        erase_bytes = FLASH_BLOCK_BYTES;
+      else if ((0 == erase_address % FLASH_HALF_BLOCK_BYTES) && (erase_end - erase_address >= FLASH_HALF_BLOCK_BYTES))
+        erase_bytes = FLASH_HALF_BLOCK_BYTES;
+      invalidate_cache();
+      start_erase(erase_address, erase_bytes);
+      erase_start_time = micros();
+      erase_state = ERASE_RUNNING;
+      break;
+  }
+}
+
+bool FlashBase::is_done(void) {
+  /* Has the erase started with begin_erase() finished?
+  */
+  return (ERASE_IDLE == erase_state) || erasing_ahead;
+}
+
+void FlashBase::erase_chip(void) {
+  /* Erase the flash chip, blocking until it is done
+  */
+  while (!begin_erase(0, len_bytes))
+    poll();
+  while (!is_done())
+    poll();
+}
+
+void FlashBase::erase_sector(unsigned int sector) {
+  /* Erase the given 4k sector, blocking until it is done
+  */
+  unsigned long sector_address = (unsigned long)sector * FLASH_SECTOR_BYTES;
+  while (!begin_erase(sector_address, sector_address + FLASH_SECTOR_BYTES))
+    poll();
+  while (!is_done())
+    poll();
+}
+
+void FlashBase::make_ready(void) {
+  /* Get the chip ready to be read or programmed, suspending an erase that is
+    still running and waiting for a page program to finish
+  */
+  unsigned long start = micros();
+  if ((ERASE_RUNNING == erase_state) && busy()) {
+    while (micros() - resume_time < FLASH_RESUME_MICROS);
+    erase_suspend();
+    erase_state = ERASE_SUSPENDED;
+  }
+  wait_busy();
+  add_latency(LATENCY_READY, start);
+}
+
+void FlashBase::read_data(unsigned long address, byte *return_array, unsigned int length_to_read) {
+  /* Read the given length of data from the given address, suspending any
+    erase that is running. Small reads go through the read cache, anything
+    a line or longer is read straight from the chip.
+  */
+  unsigned long start = micros();
+  unsigned long cached_len = len_bytes - (len_bytes % FLASH_CACHE_LINE_BYTES);
+  if ((length_to_read < FLASH_CACHE_LINE_BYTES) && (address + length_to_read <= cached_len))
+    read_cached(address, return_array, length_to_read);
+  else {
+    make_ready();
+    read_raw(address, return_array, length_to_read, choose_read_mode(length_to_read));
+    #if FLASH_LATENCY_STATS
+    bytes_read += length_to_read;
+    #endif
+  }
+  add_latency(LATENCY_READ, start);
+}
+
+bool FlashBase::supports_read_mode(FlashReadMode mode) {
+  /* Can the chip, as it is wired and clocked, read in the given mode? Every
+    chip can do a normal read, faster modes are up to the driver.
+  */
+  return READ_NORMAL == mode;
+}
+
+bool FlashBase::set_read_mode(FlashReadMode mode) {
+  /* Read in the given mode from now on, or READ_AUTO to pick one by the
+    length of each read. Returns false, changing nothing, if the chip can't.
+  */
+  if ((READ_AUTO != mode) && !supports_read_mode(mode))
+    return false;
+  read_mode = mode;
+  return true;
+}
+
+FlashReadMode FlashBase::choose_read_mode(unsigned int length_to_read) {
+  /* Bulk reads use dual output if the chip has it, since that halves the
+    data time. Otherwise a normal read if the clock allows it - fast read
+    only adds a dummy byte at the same clock - and fast read if it doesn't.
+  */
+  if (READ_AUTO != read_mode)
+    return read_mode;
+  if ((length_to_read >= FLASH_BULK_READ_BYTES) && supports_read_mode(READ_DUAL))
+    return READ_DUAL;
+  if (supports_read_mode(READ_NORMAL))
+    return READ_NORMAL;
+  if (supports_read_mode(READ_FAST))
+    return READ_FAST;
+  return READ_NORMAL;
+}
+
+void FlashBase::read_cached(unsigned long address, byte *return_array, unsigned int length_to_read) {
+  /* Read through the cache, filling lines as they are missed
+  */
+  while (length_to_read > 0) {
+    unsigned long line_address = address - (address % FLASH_CACHE_LINE_BYTES);
+    byte line = 0;
+    while ((line < FLASH_CACHE_LINES) && (cache_address[line] != line_address))
+      line++;
+    if (FLASH_CACHE_LINES == line)
+      line = fill_cache(line_address);
+    cache_last = line;
+    unsigned int offset = address - line_address;
+    unsigned int chunk = FLASH_CACHE_LINE_BYTES - offset;
+    if (chunk > length_to_read)
+      chunk = length_to_read;
+    memcpy(return_array, cache_data + line * FLASH_CACHE_LINE_BYTES + offset, chunk);
+    address += chunk;
+    return_array += chunk;
+    length_to_read -= chunk;
+  }
+}
+
+byte FlashBase::fill_cache(unsigned long line_address) {
+  /* Read the given line into the cache, returning which line it went in. If
+    it follows on from the line used last, the reading looks sequential, so
+    every line is filled in one go with the lines after it.
+  */
+  make_ready();
+  unsigned long fill_bytes = FLASH_CACHE_LINES * (unsigned long)FLASH_CACHE_LINE_BYTES;
+  if ((FLASH_CACHE_LINES > 1) && (cache_address[cache_last] + FLASH_CACHE_LINE_BYTES == line_address) &&
+      (line_address + fill_bytes <= len_bytes)) {
+    read_raw(line_address, cache_data, fill_bytes, choose_read_mode(fill_bytes));
+    #if FLASH_LATENCY_STATS
+    bytes_read += fill_bytes;
+    #endif
+    for (byte line = 0; line < FLASH_CACHE_LINES; line++)
+      cache_address[line] = line_address + line * FLASH_CACHE_LINE_BYTES;
+    return 0;
+  }
+  byte line = (cache_last + 1) % FLASH_CACHE_LINES;
+  read_raw(line_address, cache_data + line * FLASH_CACHE_LINE_BYTES, FLASH_CACHE_LINE_BYTES, choose_read_mode(FLASH_CACHE_LINE_BYTES));
+  #if FLASH_LATENCY_STATS
+  bytes_read += FLASH_CACHE_LINE_BYTES;
+  #endif
+  cache_address[line] = line_address;
+  return line;
+}
+
+void FlashBase::invalidate_cache(void) {
+  /* Forget everything in the read cache, the chip is about to change
+  */
+  for (byte line = 0; line < FLASH_CACHE_LINES; line++)
+    cache_address[line] = FLASH_NO_CACHE_LINE;
+}
+
+void FlashBase::invalidate_cache_range(unsigned long start_address, unsigned long end_address) {
+  /* Forget any lines in the read cache from the given address range
+  */
+  for (byte line = 0; line < FLASH_CACHE_LINES; line++) {
+    if ((cache_address[line] + FLASH_CACHE_LINE_BYTES > start_address) && (cache_address[line] < end_address))
+      cache_address[line] = FLASH_NO_CACHE_LINE;
+  }
+}
+
+byte FlashBase::read_byte(unsigned long address) {
+  /* Read a byte from the given address
+  */
+  byte rv;
+  read_data(address, &rv, 1);
+  return rv;
+}
+
+void FlashBase::write_enable(void) {
+  /* Set the write-enable latch
+  */
+  // pass
+}
+
+void FlashBase::write_byte(byte data) {
+  /* Write a byte to the current address
+  */
+  write_enable();
+  write_data(&data, 1);
+}
+
+void FlashBase::chip_query(void) {
+  /* Query the flash chip and print information about it to the serial line
+  */
+  byte flash_info[] = {0, 0, 0, 0, 0, 0};
+  read_flash_info(flash_info);
+  sprintf_P(debug_string, PSTR("flash_info: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x"),
+    flash_info[0], flash_info[1], flash_info[2], flash_info[3], flash_info[4], flash_info[5]);
+  Serial.println(debug_string);
+}
+
+void FlashBase::wait_busy(void) {
+  /* Spin while the SPI busy line is high
+  */
+  while(busy());
+}
+
+void FlashBase::add_latency(FlashLatencyOp op, unsigned long start) {
+  /* Count an operation that started at the given micros() in its histogram
+  */
+  #if FLASH_LATENCY_STATS
+  unsigned long elapsed = micros() - start;
+  FlashLatency *stats = &latency[op];
+  if ((0 == stats->count) || (elapsed < stats->min))
+    stats->min = elapsed;
+  if (elapsed > stats->max)
+    stats->max = elapsed;
+  stats->count++;
+  stats->total += elapsed;
+  byte bucket = 0;
+  for (unsigned long bound = 4; (elapsed >= bound) && (bucket < FLASH_LATENCY_BUCKETS - 1); bound <<= 1)
+    bucket++;
+  stats->buckets[bucket]++;
+  #endif
+}
+
+void FlashBase::reset_latency(void) {
+  /* Start the latency histograms and byte counts again
+  */
+  #if FLASH_LATENCY_STATS
+  memset(latency, 0, sizeof(latency));
+  bytes_read = 0;
+  bytes_programmed = 0;
+  #endif
+}
+
+void FlashBase::print_latency(void) {
+  /* Print the latency of each operation, then its histogram as the upper
+    bound of each bucket in microseconds and how many were under it
+  */
+  #if FLASH_LATENCY_STATS
+  const char *names[] = {"write", "read", "erase", "ready"};
+  sprintf_P(debug_string, PSTR("flash_bytes: read(%lu) programmed(%lu)"), bytes_read, bytes_programmed);
+  Serial.println(debug_string);
+  for (byte op = 0; op < LATENCY_OPS; op++) {
+    FlashLatency *stats = &latency[op];
+    sprintf_P(debug_string, PSTR("flash_latency(%s): count(%lu) min(%lu) mean(%lu) max(%lu)"), names[op], stats->count,
+      stats->min, stats->count ? stats->total / stats->count : 0, stats->max);
+    Serial.println(debug_string);
+    Serial.print(F("  "));
+    unsigned long bound = 4;
+    for (byte bucket = 0; bucket < FLASH_LATENCY_BUCKETS; bucket++, bound <<= 1) {
+      if (0 == stats->buckets[bucket])
+        continue;
+      if (FLASH_LATENCY_BUCKETS - 1 == bucket)
+        sprintf_P(debug_string, PSTR("more:%lu"), stats->buckets[bucket]);
+      else
+        sprintf_P(debug_string, PSTR("%lu:%lu "), bound, stats->buckets[bucket]);
+      Serial.print(debug_string);
+    }
+    Serial.println();
+  }
+  #else
+  Serial.println(F("flash latency stats are off"));
+  #endif
+}
@@ -1,42 +1,153 @@
-/*
-The base for flash devices.
-*/
-
-#ifndef FLASH_BASE_H
-#define FLASH_BASE_H
-
-void print_data_array_256(byte *data_array);
-
-class FlashBase {
-  public:
-    FlashBase();
-    
-    virtual void read_data(unsigned long address, byte *return_array, unsigned int length_to_read) = 0;
-    virtual void write_data(byte *data, unsigned int length_to_write) = 0;
-    
-    virtual void read_flash_info(byte *return_array) = 0;
-    virtual void erase_chip(void) = 0;
-    virtual void erase_sector(unsigned int sector) = 0;
-    virtual byte read_status_reg1(void) = 0;
-    virtual byte read_status_reg2(void) = 0;
-    virtual unsigned short read_status_reg_write(void) = 0;
-    virtual bool busy(void) = 0;
-    
-    void test_flash(void);
-    void init(void);
-    unsigned long find_next_write_address(void);
-    void set_write_address(unsigned long address);
-    byte read_byte(unsigned long address);
-    void write_enable(void);
-    void write_byte(byte data);
-    void chip_query(void);
-    void wait_busy(void);
-
-    unsigned long len_bytes;
-    char* debug_string;
-    
-  protected:
-    unsigned long write_address;
-};
-
-#endif
+/*
+The base for flash devices.
+*/
+
+#ifndef FLASH_BASE_H
+#define FLASH_BASE_H
+
+#define FLASH_PAGE_BYTES 256  // the largest program operation the chip accepts
+#define FLASH_SECTOR_BYTES 4096  // the smallest erase operation the chip accepts
+#define FLASH_HALF_BLOCK_BYTES 32768  // the middle erase operation
+#define FLASH_BLOCK_BYTES 65536  // the largest erase operation that can be suspended
+#define FLASH_NO_WRITE_HINT 0xffff  // what a blank EEPROM hands back
+#define FLASH_RESUME_MICROS 20  // the chip needs this long after an erase resume before it can be suspended again
+#ifndef FLASH_CACHE_LINES
+#define FLASH_CACHE_LINES 2  // lines in the read cache for small reads, at least one
+#endif
+#ifndef FLASH_CACHE_LINE_BYTES
+#define FLASH_CACHE_LINE_BYTES 32  // a power of two, no bigger than a page
+#endif
+#define FLASH_NO_CACHE_LINE 0xffffffff
+#define FLASH_BULK_READ_BYTES 64  // reads this long are worth the extra command bytes of dual output
+#ifndef FLASH_LATENCY_STATS
+#define FLASH_LATENCY_STATS 0  // 1 to time flash operations, at 352 bytes of RAM
+#endif
+#define FLASH_LATENCY_BUCKETS 18  // 0-3us, then doubling from 4us, the last is 262ms and up
+
+void print_data_array_256(byte *data_array);
+
+enum FlashReadMode {
+  READ_AUTO,  // the cheapest mode the chip supports at its clock for the length being read
+  READ_NORMAL,  // read data, 0x03 on most chips - no dummy byte, but a lower clock limit
+  READ_FAST,  // fast read, 0x0b - a dummy byte after the address, any clock
+  READ_DUAL  // dual output fast read, 0x3b - needs both data lines wired as inputs
+};
+
+enum FlashEraseState {
+  ERASE_IDLE,  // nothing left to erase
+  ERASE_WAITING,  // more to erase, but no erase command in flight
+  ERASE_RUNNING,  // an erase command is in flight
+  ERASE_SUSPENDED  // an erase command is suspended so the chip can be read or programmed
+};
+
+enum FlashLatencyOp {
+  LATENCY_WRITE,  // a write_data() call, including any page program and waiting for the erase ahead
+  LATENCY_READ,  // a read_data() call
+  LATENCY_ERASE,  // an erase command from starting it to seeing it done, suspensions and all
+  LATENCY_READY,  // waiting for the chip to be ready before a read or program
+  LATENCY_OPS
+};
+
+struct FlashLatency {  // microseconds
+  unsigned long count;
+  unsigned long total;
+  unsigned long min;
+  unsigned long max;
+  unsigned long buckets[FLASH_LATENCY_BUCKETS];  // as wide as count, so none saturates first
+};
+
+class FlashBase {
+  public:
+    FlashBase();
+    
+    // the chip-specific operations, FlashBase makes sure the chip is ready first
+    virtual void read_raw(unsigned long address, byte *return_array, unsigned int length_to_read, FlashReadMode mode) = 0;
+    virtual void program_page(unsigned long address, byte *data, unsigned int length_to_write) = 0;
+    virtual void start_erase(unsigned long address, unsigned long erase_bytes) = 0;
+    virtual void erase_suspend(void) = 0;
+    virtual void erase_resume(void) = 0;
+    
+    virtual void read_flash_info(byte *return_array) = 0;
+    virtual byte read_status_reg1(void) = 0;
+    virtual byte read_status_reg2(void) = 0;
+    virtual unsigned short read_status_reg_write(void) = 0;
+    virtual bool busy(void) = 0;
+    virtual bool supports_read_mode(FlashReadMode mode);
+    
+    void test_flash(void);
+    void benchmark(void);
+    void init(void);
+    unsigned long find_next_write_address(void);
+    void set_write_address(unsigned long address);
+    unsigned long get_write_address(void);
+    void set_write_hint(unsigned int sector);
+    unsigned int get_write_sector(void);
+    void read_data(unsigned long address, byte *return_array, unsigned int length_to_read);
+    bool set_read_mode(FlashReadMode mode);
+    void write_data(byte *data, unsigned int length_to_write);
+    bool write_ready(unsigned int length_to_write);
+    void program_data(unsigned long address, byte *data, unsigned int length_to_write);
+    void flush(void);
+    bool begin_erase(unsigned long start_address, unsigned long end_address);
+    bool begin_erase_used(void);
+    void set_erase_ahead(byte sectors);
+    bool in_erased_gap(unsigned long address);
+    unsigned long ring_distance(unsigned long from, unsigned long to);
+    unsigned long ring_address(unsigned long address, long offset);
+    void read_ring(unsigned long address, byte *return_array, unsigned int length_to_read);
+    void poll(void);
+    bool is_done(void);
+    void erase_chip(void);
+    void erase_sector(unsigned int sector);
+    byte read_byte(unsigned long address);
+    void write_enable(void);
+    void write_byte(byte data);
+    void chip_query(void);
+    void wait_busy(void);
+    void reset_latency(void);
+    void print_latency(void);
+
+    unsigned long len_bytes;
+    unsigned long data_start;  // appended data starts here, anything before it is reserved
+    char* debug_string;
+    #if FLASH_LATENCY_STATS
+    FlashLatency latency[LATENCY_OPS];
+    unsigned long bytes_read;  // from the chip, so cache hits don't count
+    unsigned long bytes_programmed;
+    #endif
+    
+  protected:
+    bool page_is_blank(unsigned long page);
+    unsigned long search_write_address(unsigned long first_page, unsigned long end_page);
+    unsigned long search_ring_write_address(void);
+    void start_erase_range(unsigned long start_address, unsigned long end_address);
+    void wait_erased_ahead(void);
+    unsigned long erased_ahead_needed(void);
+    void make_ready(void);
+    FlashReadMode choose_read_mode(unsigned int length_to_read);
+    void read_cached(unsigned long address, byte *return_array, unsigned int length_to_read);
+    byte fill_cache(unsigned long line_address);
+    void invalidate_cache(void);
+    void invalidate_cache_range(unsigned long start_address, unsigned long end_address);
+    void add_latency(FlashLatencyOp op, unsigned long start);
+
+    unsigned long write_address;
+    unsigned int write_hint;  // the sector the write address was last known to be in
+    byte write_buffer[FLASH_PAGE_BYTES];  // staged data that ends at write_address
+    unsigned int write_buffer_len;
+    FlashEraseState erase_state;
+    unsigned long erase_address;  // the start of the sector or block being erased
+    unsigned long erase_end;
+    unsigned long erase_bytes;  // the size of the erase command in flight
+    unsigned long resume_time;  // micros() when the erase was last resumed
+    unsigned long erase_start_time;  // micros() when the erase command in flight was sent
+    byte erase_ahead_sectors;  // how many sectors to keep erased ahead of the write address, zero for none
+    unsigned long erased_until;  // everything from the write address up to here is erased
+    bool erasing_ahead;  // is the erase in flight one of ours, rather than begin_erase()?
+    byte cache_data[FLASH_CACHE_LINES * FLASH_CACHE_LINE_BYTES];  // lines are adjacent so a sequential fill can read them all at once
+    unsigned long cache_address[FLASH_CACHE_LINES];  // the flash address of each line, or FLASH_NO_CACHE_LINE
+    byte cache_last;  // the line used last
+    FlashReadMode read_mode;
+};
+
+#endif
@@ -0,0 +1,235 @@
+#include "Arduino.h"
+#include "SessionDirectory.h"
+#include <stddef.h>
+
+SessionDirectory::SessionDirectory(FlashBase *flash_device) {
+  flash = flash_device;
+  active_sector = 0;
+  generation = 0;
+  num_entries = 0;
+  max_entries = 0;
+  first_live = 0;
+  first_live_start = 0;
+  last_open = false;
+}
+
+void SessionDirectory::init(void) {
+  /* Reserve the directory sectors at the start of the flash and count the
+    entries in the live one. This must be called before the flash is
+    initialised, so that the write address is searched for after the
+    directory.
+  */
+  num_entries = 0;
+  max_entries = 0;
+  first_live = 0;
+  last_open = false;
+  if (flash->len_bytes <= DIRECTORY_SECTORS * FLASH_SECTOR_BYTES) {
+    Serial.println(F("flash too small for a session directory"));
+    return;
+  }
+  flash->data_start = DIRECTORY_SECTORS * FLASH_SECTOR_BYTES;
+  max_entries = DIRECTORY_MAX_ENTRIES;
+  // the live sector is the one with the newest header
+  DirectoryHeader header;
+  generation = 0;
+  for (byte sector = 0; sector < DIRECTORY_SECTORS; sector++) {
+    if (read_header(sector, &header) && (header.generation > generation)) {
+      active_sector = sector;
+      generation = header.generation;
+    }
+  }
+  if (0 == generation) {
+    Serial.println(F("starting a new session directory"));
+    flash->erase_sector(0);
+    start_sector(0, 1);
+    return;
+  }
+  // entries are only ever appended, so binary search for the first unused one
+  unsigned int first = 0;
+  unsigned int end = max_entries;
+  while (first < end) {
+    unsigned int mid = first + (end - first) / 2;
+    uint32_t start_address;
+    flash->read_data(entry_address(mid), (byte*)&start_address, sizeof(start_address));
+    if (0xffffffff == start_address)
+      end = mid;
+    else
+      first = mid + 1;
+  }
+  num_entries = first;
+  find_first_live();
+  SessionEntry entry;
+  if (read_entry(num_entries - 1, &entry))
+    last_open = SESSION_NOT_CLOSED == entry.length;
+}
+
+void SessionDirectory::reset(void) {
+  /* Start again, after the directory has been erased along with the chip
+  */
+  if (0 == max_entries)
+    return;
+  start_sector(0, 1);
+}
+
+void SessionDirectory::update(void) {
+  /* Drop the oldest session once a ring log has erased the start of it. This
+    only looks at one session, so call it regularly.
+  */
+  if (first_live + 1 >= num_entries)
+    return;  // the newest session is never dropped
+  if (!flash->in_erased_gap(first_live_start))
+    return;
+  byte dropped = 0;
+  flash->program_data(entry_address(first_live) + offsetof(SessionEntry, dropped), &dropped, 1);
+  first_live++;
+  find_first_live();
+}
+
+bool SessionDirectory::open_session(byte record_version, byte record_len) {
+  /* Add an entry for a new session starting at the current write address
+  */
+  if ((max_entries <= num_entries) && (0 != first_live))
+    compact();
+  if (max_entries <= num_entries) {
+    Serial.println(F("session directory full"));
+    return false;
+  }
+  flash->flush();
+  SessionEntry entry;
+  memset(&entry, 0xff, sizeof(entry));
+  entry.start_address = flash->get_write_address();
+  entry.record_version = record_version;
+  entry.record_len = record_len;
+  entry.open_check_byte = calculate_check((byte*)&entry, 7);
+  flash->program_data(entry_address(num_entries), (byte*)&entry, sizeof(entry));
+  num_entries++;
+  last_open = true;
+  if (num_entries == first_live + 1)
+    first_live_start = entry.start_address;
+  return true;
+}
+
+bool SessionDirectory::close_session(void) {
+  /* Record the length of the open session, which ends at the current write
+    address. The length bytes are still erased, so they can be programmed now.
+  */
+  if (!session_open())
+    return false;
+  flash->flush();
+  SessionEntry entry;
+  read_entry(num_entries - 1, &entry);
+  entry.length = flash->ring_distance(entry.start_address, flash->get_write_address());
+  entry.close_check_byte = calculate_check((byte*)&entry.length, 6);
+  flash->program_data(entry_address(num_entries - 1) + offsetof(SessionEntry, length), (byte*)&entry.length, 7);
+  last_open = false;
+  return true;
+}
+
+bool SessionDirectory::read_entry(unsigned int index, SessionEntry *entry) {
+  /* Read the given directory entry, checking the part written at open
+  */
+  if (num_entries <= index)
+    return false;
+  flash->read_data(entry_address(index), (byte*)entry, sizeof(SessionEntry));
+  return entry->open_check_byte == calculate_check((byte*)entry, 7);
+}
+
+unsigned int SessionDirectory::num_sessions(void) {
+  /* How many sessions does the directory know about, dropped ones included?
+  */
+  return num_entries;
+}
+
+bool SessionDirectory::session_open(void) {
+  /* Has the last session in the directory been opened, but not closed?
+  */
+  return last_open;
+}
+
+void SessionDirectory::list(void) {
+  /* Print the directory to the serial port
+  */
+  for (unsigned int ctr = 0; ctr < num_entries; ctr++) {
+    SessionEntry entry;
+    bool ok = read_entry(ctr, &entry);
+    sprintf_P(debug_string, PSTR("session(%u) ok(%1u) dropped(%1u) start(%lu) len(%lu) ver(%u) reclen(%u)"),
+      ctr, ok, 0xff != entry.dropped, (unsigned long)entry.start_address, (unsigned long)entry.length,
+      entry.record_version, entry.record_len);
+    Serial.println(debug_string);
+  }
+}
+
+void SessionDirectory::start_sector(byte sector, uint32_t new_generation) {
+  /* Make the given, erased, sector the live directory by writing its header
+  */
+  DirectoryHeader header;
+  memset(&header, 0xff, sizeof(header));
+  memcpy(header.magic, DIRECTORY_MAGIC_BYTES, sizeof(header.magic));
+  header.generation = new_generation;
+  header.check_byte = calculate_check((byte*)&header, sizeof(header) - 1);
+  flash->program_data((unsigned long)sector * FLASH_SECTOR_BYTES, (byte*)&header, sizeof(header));
+  active_sector = sector;
+  generation = new_generation;
+  num_entries = 0;
+  first_live = 0;
+  last_open = false;
+}
+
+bool SessionDirectory::read_header(byte sector, DirectoryHeader *header) {
+  /* Read the header of a directory sector, checking the magic bytes and checksum
+  */
+  flash->read_data((unsigned long)sector * FLASH_SECTOR_BYTES, (byte*)header, sizeof(DirectoryHeader));
+  int res = memcmp(header->magic, DIRECTORY_MAGIC_BYTES, sizeof(header->magic));
+  return (0 == res) && (header->check_byte == calculate_check((byte*)header, sizeof(DirectoryHeader) - 1));
+}
+
+void SessionDirectory::compact(void) {
+  /* Copy the sessions that have not been dropped into the spare sector, then
+    make that the live one. The new header goes in last, so a power cut part
+    way through leaves the old sector live.
+  */
+  byte new_sector = (active_sector + 1) % DIRECTORY_SECTORS;
+  unsigned long new_address = (unsigned long)new_sector * FLASH_SECTOR_BYTES;
+  flash->erase_sector(new_sector);
+  SessionEntry entry;
+  for (unsigned int ctr = first_live; ctr < num_entries; ctr++) {
+    flash->read_data(entry_address(ctr), (byte*)&entry, sizeof(entry));
+    flash->program_data(new_address + (ctr - first_live + 1) * DIRECTORY_ENTRY_BYTES, (byte*)&entry, sizeof(entry));
+  }
+  unsigned int live_entries = num_entries - first_live;
+  bool was_open = last_open;
+  start_sector(new_sector, generation + 1);
+  num_entries = live_entries;
+  last_open = was_open;
+  find_first_live();
+  sprintf_P(debug_string, PSTR("compacted session directory, %u sessions"), num_entries);
+  Serial.println(debug_string);
+}
+
+void SessionDirectory::find_first_live(void) {
+  /* Skip over dropped sessions to the oldest one still in the flash
+  */
+  SessionEntry entry;
+  while (read_entry(first_live, &entry)) {
+    if (0xff == entry.dropped) {
+      first_live_start = entry.start_address;
+      return;
+    }
+    first_live++;
+  }
+}
+
+unsigned long SessionDirectory::entry_address(unsigned int index) {
+  /* The flash address of the given directory entry in the live sector
+  */
+  return (unsigned long)active_sector * FLASH_SECTOR_BYTES + (unsigned long)(index + 1) * DIRECTORY_ENTRY_BYTES;
+}
+
+byte SessionDirectory::calculate_check(byte *data, byte len) {
+  /* Calculate the XOR checksum of the given data
+  */
+  byte checksum = 0;
+  for (byte ctr = 0; ctr < len; ctr++)
+    checksum ^= data[ctr];
+  return checksum;
+}
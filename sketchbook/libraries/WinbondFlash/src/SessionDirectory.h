@@ -0,0 +1,73 @@
+/*
+A directory of logging sessions, kept in the first sectors of the flash chip.
+*/
+
+#ifndef SESSION_DIRECTORY_H
+#define SESSION_DIRECTORY_H
+
+#include "Arduino.h"
+#include "FlashBase.h"
+
+#define DIRECTORY_SECTORS 2  // the live one, and a spare to compact it into when it fills up
+#define DIRECTORY_ENTRY_BYTES 16
+#define DIRECTORY_MAX_ENTRIES ((FLASH_SECTOR_BYTES / DIRECTORY_ENTRY_BYTES) - 1)  // the first slot is the header
+#define SESSION_NOT_CLOSED 0xffffffff
+
+const byte DIRECTORY_MAGIC_BYTES[] = {0xd1, 0x5e, 0xc7, 0x0e, 0x1a, 0x2b, 0x3c, 0xdd};
+
+struct DirectoryHeader {  // 16 bytes total, the first slot in a directory sector
+  byte magic[8];
+  uint32_t generation;  // the sector with the highest generation is the live one
+  byte future_use[3];
+  byte check_byte;
+};
+
+struct SessionEntry {  // 16 bytes total, fixed-width so the layout matches on the host
+  // written when the session opens
+  uint32_t start_address;
+  byte record_version;
+  byte record_len;
+  byte future_use_open;
+  byte open_check_byte;
+  // written when the session closes - still 0xff until then
+  uint32_t length;
+  byte future_use_close[2];
+  byte close_check_byte;
+  // programmed to zero once a ring log has erased the start of the session
+  byte dropped;
+};
+
+class SessionDirectory {
+  public:
+    SessionDirectory(FlashBase *flash_device);
+    void init(void);
+    void reset(void);
+    void update(void);
+    bool open_session(byte record_version, byte record_len);
+    bool close_session(void);
+    bool read_entry(unsigned int index, SessionEntry *entry);
+    unsigned int num_sessions(void);
+    bool session_open(void);
+    void list(void);
+
+    char* debug_string;
+
+  private:
+    void start_sector(byte sector, uint32_t new_generation);
+    bool read_header(byte sector, DirectoryHeader *header);
+    void compact(void);
+    void find_first_live(void);
+    unsigned long entry_address(unsigned int index);
+    byte calculate_check(byte *data, byte len);
+
+    FlashBase *flash;
+    byte active_sector;
+    uint32_t generation;
+    unsigned int num_entries;
+    unsigned int max_entries;  // zero if the chip is too small to hold a directory
+    unsigned int first_live;  // the oldest session that has not been dropped
+    unsigned long first_live_start;
+    bool last_open;  // is the last entry still waiting for its length?
+};
+
+#endif
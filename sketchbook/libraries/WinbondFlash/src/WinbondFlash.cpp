@@ -1,156 +1,190 @@
-#include "Arduino.h"
-#include "WinbondFlash.h"
-#include <SPI.h>
-
-#define DEBUG_LOGGING
-
-#define CS_LOW digitalWrite(cs_pin, LOW)
-#define CS_HIGH digitalWrite(cs_pin, HIGH)
-
-WinbondFlash::WinbondFlash(byte chip_select, byte len_mb){
-  cs_pin = chip_select;
-  len_mb = len_mb;
-  len_bytes = len_mb;
-  len_bytes <<= 20;
-  write_address = 0;
-  pinMode(cs_pin, OUTPUT);
-  SPI.begin();
-  CS_LOW;
-}
-
-void WinbondFlash::read_data(unsigned long address, byte *return_array, unsigned int length_to_read) {
-  /* Read the given length of data from the given address
-  */
-  CS_LOW;
-  SPI.transfer(0x03);
-  SPI.transfer((address >> 16) & 0xff);
-  SPI.transfer((address >> 8) & 0xff);
-  SPI.transfer((address >> 0) & 0xff);
-  for (unsigned int ctr = 0; ctr < length_to_read; ctr++)
-    return_array[ctr] = SPI.transfer(0x00);
-  CS_HIGH;
-}
-
-void WinbondFlash::write_enable(void) {
-  /* Set the write-enable latch
-  */
-  CS_LOW;
-  SPI.transfer(0x06);
-  CS_HIGH;
-}
-
-void WinbondFlash::write_data(byte *data, unsigned int length_to_write) {
-  /* Write data of the given length to the current address
-  */
-  if (len_bytes <= write_address) {
-    #ifdef DEBUG_LOGGING
-    sprintf(debug_string, "cannot write to address %lu, larger than flash size %lu", write_address, len_bytes);
-    Serial.println(debug_string);
-    #endif
-    return;
-  }
-  write_enable();
-  CS_LOW;
-  SPI.transfer(0x02);
-  SPI.transfer((write_address >> 16) & 0xff);
-  SPI.transfer((write_address >> 8) & 0xff);
-  SPI.transfer((write_address >> 0) & 0xff);
-  for (unsigned int ctr = 0; ctr < length_to_write; ctr++) {
-    SPI.transfer(data[ctr]);
-    write_address++;
-  }
-  CS_HIGH;
-}
-
-void WinbondFlash::read_flash_info(byte *return_array) {
-  /* Read chip-specific info from the SPI flash chip
-  */
-  CS_LOW;
-  return_array[0] = SPI.transfer(0x90);
-  return_array[1] = SPI.transfer(0x00);
-  return_array[2] = SPI.transfer(0x00);
-  return_array[3] = SPI.transfer(0x00);
-  return_array[4] = SPI.transfer(0x00);
-  return_array[5] = SPI.transfer(0x00);
-  CS_HIGH;
-}
-
-void WinbondFlash::erase_chip(void) {
-  /* Erase the flash chip
-  */
-  Serial.println("erasing entire flash chip...");
-  write_enable();
-  CS_LOW;
-  SPI.transfer(0xc7);
-  CS_HIGH;
-  unsigned int ctr = 0;
-  while(busy()) {
-    Serial.print("busy_");
-    Serial.println(ctr);
-    ctr++;
-  }
-  Serial.println("done erasing.");
-}
-
-void WinbondFlash::erase_sector(unsigned int sector) {
-  /* Erase the given 4k sector
-  */
-  Serial.print("erasing flash sector ");
-  Serial.print(sector);
-  Serial.println("...");
-  unsigned long sector_address = sector << 12;
-  write_enable();
-  CS_LOW;
-  SPI.transfer(0x20);
-  SPI.transfer((sector_address >> 16) & 0xff);
-  SPI.transfer((sector_address >> 8) & 0xff);
-  SPI.transfer((sector_address >> 0) & 0xff);
-  CS_HIGH;
-  unsigned int ctr = 0;
-  while(busy()) {
-    Serial.print("busy_");
-    Serial.println(ctr);
-    ctr++;
-  }
-  Serial.println("done erasing sector.");
-}
-
-byte WinbondFlash::read_status_reg1(void) {
-  /* Read status register 1 from the SPI flash chip
-  */
-  CS_LOW;
-  SPI.transfer(0x05);
-  byte result = SPI.transfer(0x00);
-  CS_HIGH;
-  return result;
-}
-
-byte WinbondFlash::read_status_reg2(void) {
-  /* Read status register 1 from the SPI flash chip
-  */
-  CS_LOW;
-  SPI.transfer(0x35);
-  byte result = SPI.transfer(0x00);
-  CS_HIGH;
-  return result;
-}
-
-unsigned short WinbondFlash::read_status_reg_write(void) {
-  /* Read the write status register from the SPI flash chip
-  */
-//  write_enable();
-//  CS_LOW;
-//  SPI.transfer(0x01);
-//  byte result_lsb = SPI.transfer(0x00);
-//  byte result_msb = SPI.transfer(0x00);
-//  CS_HIGH;
-//  return result_lsb + (result_msb << 8);
-  return 0;
-}
-
-bool WinbondFlash::busy(void) {
-  /* Is the SPI chip busy?
-  */
-  return read_status_reg1() & 0x01;
-}
-
+#include "Arduino.h"
+#include "WinbondFlash.h"
+
+#define DEBUG_LOGGING
+
+WinbondFlash::WinbondFlash(byte chip_select, byte len_mb, unsigned long spi_clock){
+  cs_pin = chip_select;
+  cs_port = portOutputRegister(digitalPinToPort(cs_pin));
+  cs_mask = digitalPinToBitMask(cs_pin);
+  set_spi_clock(spi_clock);
+  len_mb = len_mb;
+  len_bytes = len_mb;
+  len_bytes <<= 20;
+  write_address = 0;
+  digitalWrite(cs_pin, HIGH);
+  pinMode(cs_pin, OUTPUT);
+  SPI.begin();
+}
+
+void WinbondFlash::set_spi_clock(unsigned long spi_clock) {
+  /* Change the SPI clock, for boards or wiring that can't keep up with the chip
+  */
+  spi_settings = SPISettings(spi_clock, MSBFIRST, SPI_MODE0);
+  #ifdef F_CPU
+  if (spi_clock > F_CPU / 2)
+    spi_clock = F_CPU / 2;
+  #endif
+  this->spi_clock = spi_clock;
+}
+
+void WinbondFlash::send_command(byte command, unsigned long address) {
+  /* Send a command and the 24-bit address it works on, chip select must already be low
+  */
+  SPI.transfer(command);
+  SPI.transfer((address >> 16) & 0xff);
+  SPI.transfer((address >> 8) & 0xff);
+  SPI.transfer((address >> 0) & 0xff);
+}
+
+void WinbondFlash::transfer_out(byte *data, unsigned int length_to_write) {
+  /* Send a buffer without overwriting it with what comes back, the way
+    SPI.transfer(buffer, length) does. On AVR the next byte is loaded while
+    the last one is still going out.
+  */
+  if (0 == length_to_write)
+    return;
+  #ifdef SPDR
+  SPDR = *data++;
+  while (--length_to_write > 0) {
+    byte next = *data++;
+    while (!(SPSR & _BV(SPIF)));
+    SPDR = next;
+  }
+  while (!(SPSR & _BV(SPIF)));
+  #else
+  for (unsigned int ctr = 0; ctr < length_to_write; ctr++)
+    SPI.transfer(data[ctr]);
+  #endif
+}
+
+void WinbondFlash::read_raw(unsigned long address, byte *return_array, unsigned int length_to_read, FlashReadMode mode) {
+  /* Read the given length of data from the given address. The chip ignores
+    what is sent while it reads out, so the buffer is transferred in place.
+  */
+  select();
+  if (READ_FAST == mode) {
+    send_command(0x0b, address);
+    SPI.transfer(0x00);  // the dummy byte
+  }
+  else {
+    send_command(0x03, address);
+  }
+  SPI.transfer(return_array, length_to_read);
+  deselect();
+}
+
+bool WinbondFlash::supports_read_mode(FlashReadMode mode) {
+  /* A normal read is only good up to WINBOND_READ_CLOCK. Dual output needs
+    the chip's DO and DI both read back at once, which the hardware SPI port
+    can't do, so it is never available here.
+  */
+  if (READ_NORMAL == mode)
+    return spi_clock <= WINBOND_READ_CLOCK;
+  return READ_FAST == mode;
+}
+
+void WinbondFlash::write_enable(void) {
+  /* Set the write-enable latch
+  */
+  select();
+  SPI.transfer(0x06);
+  deselect();
+}
+
+void WinbondFlash::program_page(unsigned long address, byte *data, unsigned int length_to_write) {
+  /* Program data into a single page - the chip wraps around inside the page
+    if this crosses a page boundary, so FlashBase splits writes before they
+    get here.
+  */
+  write_enable();
+  select();
+  send_command(0x02, address);
+  transfer_out(data, length_to_write);
+  deselect();
+}
+
+void WinbondFlash::read_flash_info(byte *return_array) {
+  /* Read chip-specific info from the SPI flash chip
+  */
+  select();
+  return_array[0] = SPI.transfer(0x90);
+  return_array[1] = SPI.transfer(0x00);
+  return_array[2] = SPI.transfer(0x00);
+  return_array[3] = SPI.transfer(0x00);
+  return_array[4] = SPI.transfer(0x00);
+  return_array[5] = SPI.transfer(0x00);
+  deselect();
+}
+
+void WinbondFlash::start_erase(unsigned long address, unsigned long erase_bytes) {
+  /* Start erasing the 4k sector, or 32k or 64k block, at the given address -
+    this returns straight away and FlashBase polls busy() for the end of it
+  */
+  byte command = 0x20;
+  if (FLASH_BLOCK_BYTES == erase_bytes)
+    command = 0xd8;
+  else if (FLASH_HALF_BLOCK_BYTES == erase_bytes)
+    command = 0x52;
+  write_enable();
+  select();
+  send_command(command, address);
+  deselect();
+}
+
+void WinbondFlash::erase_suspend(void) {
+  /* Suspend the sector or block erase in progress, so the rest of the chip can
+    be read or programmed
+  */
+  select();
+  SPI.transfer(0x75);
+  deselect();
+}
+
+void WinbondFlash::erase_resume(void) {
+  /* Resume a suspended sector or block erase
+  */
+  select();
+  SPI.transfer(0x7a);
+  deselect();
+}
+
+byte WinbondFlash::read_status_reg1(void) {
+  /* Read status register 1 from the SPI flash chip
+  */
+  select();
+  SPI.transfer(0x05);
+  byte result = SPI.transfer(0x00);
+  deselect();
+  return result;
+}
+
+byte WinbondFlash::read_status_reg2(void) {
+  /* Read status register 1 from the SPI flash chip
+  */
+  select();
+  SPI.transfer(0x35);
+  byte result = SPI.transfer(0x00);
+  deselect();
+  return result;
+}
+
+unsigned short WinbondFlash::read_status_reg_write(void) {
+  /* Read the write status register from the SPI flash chip
+  */
+//  write_enable();
+//  select();
+//  SPI.transfer(0x01);
+//  byte result_lsb = SPI.transfer(0x00);
+//  byte result_msb = SPI.transfer(0x00);
+//  deselect();
+//  return result_lsb + (result_msb << 8);
+  return 0;
+}
+
+bool WinbondFlash::busy(void) {
+  /* Is the SPI chip busy?
+  */
+  return read_status_reg1() & 0x01;
+}
+
@@ -1,30 +1,47 @@
-/*
-Interface to the Winbond W25Q64BV via SPI.
-*/
-
-#ifndef WINBOND_FLASH_H
-#define WINBOND_FLASH_H
-
-#include "Arduino.h"
-#include "FlashBase.h"
-
-class WinbondFlash : public FlashBase {
-  public:
-    WinbondFlash(byte chip_select, byte len_mb);
-    void read_data(unsigned long address, byte *return_array, unsigned int length_to_read);
-    void write_enable(void);
-    void write_data(byte *data, unsigned int length_to_write);
-    void read_flash_info(byte *return_array);
-    void erase_chip(void);
-    void erase_sector(unsigned int sector);
-    byte read_status_reg1(void);
-    byte read_status_reg2(void);
-    unsigned short read_status_reg_write(void);
-    bool busy(void);
-
-  private:
-    byte cs_pin;
-    byte len_mb;
-};
-
-#endif
+/*
+Interface to the Winbond W25Q64BV via SPI.
+*/
+
+#ifndef WINBOND_FLASH_H
+#define WINBOND_FLASH_H
+
+#include "Arduino.h"
+#include "FlashBase.h"
+#include <SPI.h>
+
+#define WINBOND_SPI_CLOCK 80000000  // the fastest the chip runs, SPISettings caps it at what the board can do
+#define WINBOND_READ_CLOCK 50000000  // the fastest it does a plain 0x03 read, anything faster needs fast read
+
+class WinbondFlash : public FlashBase {
+  public:
+    WinbondFlash(byte chip_select, byte len_mb, unsigned long spi_clock = WINBOND_SPI_CLOCK);
+    void set_spi_clock(unsigned long spi_clock);
+    void read_raw(unsigned long address, byte *return_array, unsigned int length_to_read, FlashReadMode mode);
+    bool supports_read_mode(FlashReadMode mode);
+    void write_enable(void);
+    void program_page(unsigned long address, byte *data, unsigned int length_to_write);
+    void read_flash_info(byte *return_array);
+    void start_erase(unsigned long address, unsigned long erase_bytes);
+    void erase_suspend(void);
+    void erase_resume(void);
+    byte read_status_reg1(void);
+    byte read_status_reg2(void);
+    unsigned short read_status_reg_write(void);
+    bool busy(void);
+
+  private:
+    // every chip select is a whole SPI transaction, so other SPI devices can use their own settings
+    inline void select(void) { SPI.beginTransaction(spi_settings); *cs_port &= ~cs_mask; }
+    inline void deselect(void) { *cs_port |= cs_mask; SPI.endTransaction(); }
+    void send_command(byte command, unsigned long address);
+    void transfer_out(byte *data, unsigned int length_to_write);
+
+    byte cs_pin;
+    volatile byte *cs_port;  // chip select is toggled straight on the port, digitalWrite() is slow
+    byte cs_mask;
+    SPISettings spi_settings;
+    unsigned long spi_clock;  // what the clock really is, after the board's limit
+    byte len_mb;
+};
+
+#endif